@@ -180,6 +180,10 @@ CONFIG_XENBUS ?= y
 CONFIG_XC ?=y
 CONFIG_LWIP ?= $(lwip)
 CONFIG_BALLOON ?= n
+# Only takes effect with XEN_INTERFACE_VERSION >= 0x0003020a
+CONFIG_GNTTAB_V2 ?= n
+# Back the libc heap with 2MB superpages on HVM/PVH
+CONFIG_HEAP_SUPERPAGES ?= n
 
 # Export config items as compiler directives
 DEFINES-$(CONFIG_PARAVIRT) += -DCONFIG_PARAVIRT
@@ -197,6 +201,8 @@ DEFINES-$(CONFIG_FBFRONT) += -DCONFIG_FBFRONT
 DEFINES-$(CONFIG_CONSFRONT) += -DCONFIG_CONSFRONT
 DEFINES-$(CONFIG_XENBUS) += -DCONFIG_XENBUS
 DEFINES-$(CONFIG_BALLOON) += -DCONFIG_BALLOON
+DEFINES-$(CONFIG_GNTTAB_V2) += -DCONFIG_GNTTAB_V2
+DEFINES-$(CONFIG_HEAP_SUPERPAGES) += -DCONFIG_HEAP_SUPERPAGES
 
 DEFINES-y += -D__XEN_INTERFACE_VERSION__=$(XEN_INTERFACE_VERSION)
 
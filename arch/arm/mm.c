@@ -22,6 +22,12 @@ unsigned long allocate_ondemand(unsigned long n, unsigned long alignment)
     BUG();
 }
 
+void free_ondemand(unsigned long va, unsigned long n)
+{
+    // FIXME
+    BUG();
+}
+
 void arch_init_mm(unsigned long *start_pfn_p, unsigned long *max_pfn_p)
 {
     int memory;
@@ -91,13 +97,15 @@ int do_map_frames(unsigned long addr,
     return -ENOSYS;
 }
 
+static paddr_t gnttab_base;
+static int gnttab_region_frames;
+
 /* Get Xen's suggested physical page assignments for the grant table. */
-static paddr_t get_gnttab_base(void)
+static void get_gnttab_base(void)
 {
     int hypervisor;
     int len = 0;
     const uint64_t *regs;
-    paddr_t gnttab_base;
 
     hypervisor = fdt_node_offset_by_compatible(device_tree, -1, "xen,xen");
     BUG_ON(hypervisor < 0);
@@ -110,31 +118,32 @@ static paddr_t get_gnttab_base(void)
     }
 
     gnttab_base = fdt64_to_cpu(regs[0]);
+    gnttab_region_frames = fdt64_to_cpu(regs[1]) >> PAGE_SHIFT;
 
     printk("FDT suggests grant table base %llx\n", (unsigned long long) gnttab_base);
-
-    return gnttab_base;
 }
 
-grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames)
+int arch_grow_gnttab(grant_entry_v1_t *table, int old_frames,
+                     int nr_grant_frames)
 {
     struct xen_add_to_physmap xatp;
     struct gnttab_setup_table setup;
     xen_pfn_t frames[nr_grant_frames];
-    paddr_t gnttab_table;
     int i, rc;
 
-    gnttab_table = get_gnttab_base();
+    if (nr_grant_frames > gnttab_region_frames)
+        return -ENOMEM;
 
-    for (i = 0; i < nr_grant_frames; i++)
+    for (i = old_frames; i < nr_grant_frames; i++)
     {
         xatp.domid = DOMID_SELF;
         xatp.size = 0;      /* Seems to be unused */
         xatp.space = XENMAPSPACE_grant_table;
         xatp.idx = i;
-        xatp.gpfn = (gnttab_table >> PAGE_SHIFT) + i;
+        xatp.gpfn = (gnttab_base >> PAGE_SHIFT) + i;
         rc = HYPERVISOR_memory_op(XENMEM_add_to_physmap, &xatp);
-        BUG_ON(rc != 0);
+        if (rc != 0)
+            return rc;
     }
 
     setup.dom = DOMID_SELF;
@@ -144,11 +153,34 @@ grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames)
     if (setup.status != 0)
     {
         printk("GNTTABOP_setup_table failed; status = %d\n", setup.status);
-        BUG();
+        return -ENOMEM;
     }
 
-    return to_virt(gnttab_table);
+    return 0;
+}
+
+grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames, int max_grant_frames)
+{
+    get_gnttab_base();
+    BUG_ON(arch_grow_gnttab(to_virt(gnttab_base), 0, nr_grant_frames));
+
+    return to_virt(gnttab_base);
+}
+
+#if __XEN_INTERFACE_VERSION__ >= 0x0003020a
+/* Status frames are not mapped on Arm, so the table stays at version 1. */
+int arch_grow_gnttab_status(grant_status_t *status, int old_frames,
+                            int nr_status_frames)
+{
+    return -ENOSYS;
+}
+
+grant_status_t *arch_init_gnttab_status(int nr_status_frames,
+                                        int max_status_frames)
+{
+    return NULL;
 }
+#endif
 
 unsigned long map_frame_virt(unsigned long mfn)
 {
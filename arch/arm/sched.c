@@ -1,5 +1,7 @@
 #include <mini-os/sched.h>
 #include <mini-os/xmalloc.h>
+#include <mini-os/slab.h>
+#include <mini-os/memtag.h>
 #include <mini-os/console.h>
 
 void arm_start_thread(void);
@@ -13,9 +15,10 @@ struct thread* arch_create_thread(char *name, void (*function)(void *),
 {
     struct thread *thread;
 
-    thread = xmalloc(struct thread);
+    thread = kmem_cache_alloc(thread_cache);
     /* We can't use lazy allocation here since the trap handler runs on the stack */
-    thread->stack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
+    thread->stack = (char *)alloc_pages_tag(STACK_SIZE_PAGE_ORDER,
+                                            MEM_TAG_STACK);
     thread->name = name;
     printk("Thread \"%s\": pointer: 0x%p, stack: 0x%p\n", name, thread,
             thread->stack);
@@ -140,6 +140,19 @@ void arch_pfn_add(unsigned long pfn, unsigned long mfn)
         do_exit();
     }
 }
+
+/* Drop the mapping and p2m entry of a page that goes back to Xen. */
+void arch_pfn_remove(unsigned long pfn)
+{
+    pte_t nullpte = { };
+    int rc;
+
+    rc = HYPERVISOR_update_va_mapping((unsigned long)pfn_to_virt(pfn),
+                                      nullpte, UVMF_INVLPG);
+    if ( rc )
+        printk("Unable to unmap pfn %lx. rc=%d\n", pfn, rc);
+    phys_to_machine_mapping[pfn] = INVALID_P2M_ENTRY;
+}
 #else
 void arch_pfn_add(unsigned long pfn, unsigned long mfn)
 {
@@ -150,6 +163,14 @@ void arch_pfn_add(unsigned long pfn, unsigned long mfn)
     if ( !(*pgt & _PAGE_PSE) )
         *pgt = (pgentry_t)(mfn << PAGE_SHIFT) | _PAGE_PRESENT | _PAGE_RW;
 }
+
+/*
+ * The 1:1 mapping of a ballooned out page may stay: the page is held
+ * allocated and never touched until balloon_up() repopulates it.
+ */
+void arch_pfn_remove(unsigned long pfn)
+{
+}
 #endif
 
 #endif
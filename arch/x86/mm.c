@@ -43,6 +43,8 @@
 #include <mini-os/types.h>
 #include <mini-os/lib.h>
 #include <mini-os/xmalloc.h>
+#include <mini-os/vaspace.h>
+#include <mini-os/memtag.h>
 #include <mini-os/e820.h>
 #include <xen/memory.h>
 
@@ -468,6 +470,7 @@ static void set_readonly(void *text, void *etext)
 #endif
 }
 
+#ifndef CONFIG_PARAVIRT
 /*
  * get the PTE for virtual address va if it exists. Otherwise NULL.
  */
@@ -502,13 +505,14 @@ static pgentry_t *get_pgt(unsigned long va)
     offset = l1_table_offset(va);
     return &tab[offset];
 }
+#endif
 
 
 /*
- * return a valid PTE for a given virtual address. If PTE does not exist,
- * allocate page-table pages.
+ * Return the L2 entry covering virtual address va, allocating the
+ * page-table pages above it if they do not exist yet.
  */
-pgentry_t *need_pgt(unsigned long va)
+static pgentry_t *need_l2_pgt(unsigned long va)
 {
     unsigned long pt_mfn;
     pgentry_t *tab;
@@ -522,7 +526,7 @@ pgentry_t *need_pgt(unsigned long va)
     offset = l4_table_offset(va);
     if ( !(tab[offset] & _PAGE_PRESENT) )
     {
-        pt_pfn = virt_to_pfn(alloc_page());
+        pt_pfn = virt_to_pfn(alloc_pages_tag(0, MEM_TAG_PAGETABLE));
         if ( !pt_pfn )
             return NULL;
         new_pt_frame(&pt_pfn, pt_mfn, offset, L3_FRAME);
@@ -534,7 +538,7 @@ pgentry_t *need_pgt(unsigned long va)
     offset = l3_table_offset(va);
     if ( !(tab[offset] & _PAGE_PRESENT) ) 
     {
-        pt_pfn = virt_to_pfn(alloc_page());
+        pt_pfn = virt_to_pfn(alloc_pages_tag(0, MEM_TAG_PAGETABLE));
         if ( !pt_pfn )
             return NULL;
         new_pt_frame(&pt_pfn, pt_mfn, offset, L2_FRAME);
@@ -542,30 +546,93 @@ pgentry_t *need_pgt(unsigned long va)
     ASSERT(tab[offset] & _PAGE_PRESENT);
     pt_mfn = pte_to_mfn(tab[offset]);
     tab = mfn_to_virt(pt_mfn);
-    offset = l2_table_offset(va);
-    if ( !(tab[offset] & _PAGE_PRESENT) )
+
+    return &tab[l2_table_offset(va)];
+}
+
+/*
+ * return a valid PTE for a given virtual address. If PTE does not exist,
+ * allocate page-table pages.
+ */
+pgentry_t *need_pgt(unsigned long va)
+{
+    unsigned long pt_mfn;
+    pgentry_t *tab;
+    unsigned long pt_pfn;
+    unsigned offset;
+
+    tab = need_l2_pgt(va);
+    if ( !tab )
+        return NULL;
+    if ( !(*tab & _PAGE_PRESENT) )
     {
-        pt_pfn = virt_to_pfn(alloc_page());
+        pt_pfn = virt_to_pfn(alloc_pages_tag(0, MEM_TAG_PAGETABLE));
         if ( !pt_pfn )
             return NULL;
-        new_pt_frame(&pt_pfn, pt_mfn, offset, L1_FRAME);
+        new_pt_frame(&pt_pfn, virt_to_mfn(tab), l2_table_offset(va),
+                     L1_FRAME);
     }
-    ASSERT(tab[offset] & _PAGE_PRESENT);
-    if ( tab[offset] & _PAGE_PSE )
-        return &tab[offset];
+    ASSERT(*tab & _PAGE_PRESENT);
+    if ( *tab & _PAGE_PSE )
+        return tab;
 
-    pt_mfn = pte_to_mfn(tab[offset]);
+    pt_mfn = pte_to_mfn(*tab);
     tab = mfn_to_virt(pt_mfn);
 
     offset = l1_table_offset(va);
     return &tab[offset];
 }
 
+#ifndef CONFIG_PARAVIRT
+/*
+ * Frames n of a do_map_frames() request, for n in done..done+511, if
+ * they form one 2MB-aligned machine-contiguous run, so the whole run can
+ * go into a single L2 entry.
+ */
+static int superpage_frames(const unsigned long *mfns, unsigned long stride,
+                            unsigned long incr, unsigned long done)
+{
+    unsigned long first = mfns[done * stride] + done * incr;
+    unsigned long i;
+
+    if ( first & (L1_PAGETABLE_ENTRIES - 1) )
+        return 0;
+    for ( i = 1; i < L1_PAGETABLE_ENTRIES; i++ )
+        if ( mfns[(done + i) * stride] + (done + i) * incr != first + i )
+            return 0;
+    return 1;
+}
+
+/*
+ * Replace the superpage mapping va by an L1 table mapping the same
+ * frames, so part of it can be changed. Returns the PTE for va.
+ */
+static pgentry_t *split_superpage(unsigned long va, pgentry_t *l2)
+{
+    pgentry_t *l1;
+    unsigned long mfn = pte_to_mfn(*l2) & ~(L1_PAGETABLE_ENTRIES - 1);
+    pgentry_t prot = (*l2 & ~PAGE_MASK) & ~_PAGE_PSE;
+    int i;
+
+    l1 = (pgentry_t *)alloc_pages_tag(0, MEM_TAG_PAGETABLE);
+    if ( !l1 )
+        return NULL;
+    for ( i = 0; i < L1_PAGETABLE_ENTRIES; i++ )
+        l1[i] = ((pgentry_t)(mfn + i) << PAGE_SHIFT) | prot;
+
+    *l2 = ((pgentry_t)virt_to_mfn(l1) << PAGE_SHIFT) | pt_prot[L1_FRAME];
+    invlpg(va);
+
+    return &l1[l1_table_offset(va)];
+}
+#endif
+
 /*
  * Reserve an area of virtual address space for mappings and Heap
  */
 static unsigned long demand_map_area_start;
 static unsigned long demand_map_area_end;
+static struct va_space demand_map_va;
 #ifdef HAVE_LIBC
 unsigned long heap, brk, heap_mapped, heap_end;
 #endif
@@ -576,6 +643,12 @@ void arch_init_demand_mapping_area(void)
     demand_map_area_end = demand_map_area_start + DEMAND_MAP_PAGES * PAGE_SIZE;
     printk("Demand map pfns at %lx-%lx.\n", demand_map_area_start,
            demand_map_area_end);
+    if ( va_space_init(&demand_map_va, demand_map_area_start,
+                       demand_map_area_end) )
+    {
+        printk("Failed to set up the demand map area!\n");
+        do_exit();
+    }
 
 #ifdef HAVE_LIBC
     heap_mapped = brk = heap = VIRT_HEAP_AREA;
@@ -584,38 +657,62 @@ void arch_init_demand_mapping_area(void)
 #endif
 }
 
-unsigned long allocate_ondemand(unsigned long n, unsigned long alignment)
+#ifdef HAVE_LIBC
+/*
+ * Back n pages of heap at va. Normally they map the zero page and are
+ * populated on first write. With CONFIG_HEAP_SUPERPAGES on HVM/PVH, a
+ * whole 2MB-aligned stretch of the request instead gets a zeroed block
+ * of real memory mapped as one superpage, if such a block is free: that
+ * saves TLB misses but pins 512 pages up front whether they are used or
+ * not.
+ */
+void map_heap_pages(unsigned long va, unsigned long n)
 {
-    unsigned long x;
-    unsigned long y = 0;
+#if defined(CONFIG_HEAP_SUPERPAGES) && !defined(CONFIG_PARAVIRT)
+    unsigned long block, mfn;
 
-    /* Find a properly aligned run of n contiguous frames */
-    for ( x = 0;
-          x <= DEMAND_MAP_PAGES - n; 
-          x = (x + y + 1 + alignment - 1) & ~(alignment - 1) )
+    while ( n >= L1_PAGETABLE_ENTRIES && !(va & L1_MASK) )
     {
-        unsigned long addr = demand_map_area_start + x * PAGE_SIZE;
-        pgentry_t *pgt = get_pgt(addr);
-        for ( y = 0; y < n; y++, addr += PAGE_SIZE ) 
+        block = try_alloc_pages(L2_PAGETABLE_SHIFT - PAGE_SHIFT);
+        if ( !block )
+            break;
+        memset((void *)block, 0, 1UL << L2_PAGETABLE_SHIFT);
+        mfn = virt_to_mfn(block);
+        if ( do_map_frames(va, &mfn, L1_PAGETABLE_ENTRIES, 0, 1, DOMID_SELF,
+                           NULL, L1_PROT) )
         {
-            if ( !(addr & L1_MASK) )
-                pgt = get_pgt(addr);
-            if ( pgt )
-            {
-                if ( *pgt & _PAGE_PRESENT )
-                    break;
-                pgt++;
-            }
-        }
-        if ( y == n )
+            free_pages((void *)block, L2_PAGETABLE_SHIFT - PAGE_SHIFT);
             break;
+        }
+        va += 1UL << L2_PAGETABLE_SHIFT;
+        n -= L1_PAGETABLE_ENTRIES;
     }
-    if ( y != n )
+#endif
+    if ( n )
+        do_map_zero(va, n);
+}
+#endif
+
+/*
+ * Reserve n pages of the demand map area, aligned on alignment pages.
+ * The range is given back by unmap_frames(), or by free_ondemand() for
+ * pages that are mapped some other way.
+ */
+unsigned long allocate_ondemand(unsigned long n, unsigned long alignment)
+{
+    unsigned long va = va_alloc(&demand_map_va, n, alignment);
+
+    if ( !va )
     {
         printk("Failed to find %ld frames!\n", n);
-        return 0;
+        va_space_dump(&demand_map_va);
     }
-    return demand_map_area_start + x * PAGE_SIZE;
+    return va;
+}
+
+void free_ondemand(unsigned long va, unsigned long n)
+{
+    va_free(&demand_map_va, va, n);
 }
 
 /*
@@ -686,12 +783,31 @@ int do_map_frames(unsigned long va,
         }
         done += todo;
 #else
+        /* A whole aligned, contiguous 2MB run takes a single L2 entry. */
+        if ( !(va & L1_MASK) && n - done >= L1_PAGETABLE_ENTRIES &&
+             superpage_frames(mfns, stride, incr, done) )
+        {
+            pgt = need_l2_pgt(va);
+            if ( !pgt )
+                return -ENOMEM;
+            if ( !(*pgt & _PAGE_PRESENT) )
+            {
+                *pgt = ((pgentry_t)(mfns[done * stride] + done * incr)
+                        << PAGE_SHIFT) | prot | _PAGE_PSE;
+                va += 1UL << L2_PAGETABLE_SHIFT;
+                done += L1_PAGETABLE_ENTRIES;
+                pgt = NULL;
+                continue;
+            }
+        }
+
         if ( !pgt || !(va & L1_MASK) )
             pgt = need_pgt(va & ~L1_MASK);
+        if ( pgt && (*pgt & _PAGE_PSE) )
+            pgt = split_superpage(va & ~L1_MASK, pgt);
         if ( !pgt )
             return -ENOMEM;
 
-        ASSERT(!(*pgt & _PAGE_PSE));
         pgt[l1_table_offset(va)] = (pgentry_t)
             (((mfns[done * stride] + done * incr) << PAGE_SHIFT) | prot);
         done++;
@@ -716,16 +832,20 @@ void *map_frames_ex(const unsigned long *mfns, unsigned long n,
         return NULL;
 
     if ( do_map_frames(va, mfns, n, stride, incr, id, err, prot) )
+    {
+        free_ondemand(va, n);
         return NULL;
+    }
 
     return (void *)va;
 }
 
 /*
- * Unmap nun_frames frames mapped at virtual address va.
+ * Remove the mappings of num_frames frames at virtual address va. The
+ * address space stays reserved, so it can be mapped again in place.
  */
 #define UNMAP_BATCH ((STACK_SIZE / 2) / sizeof(multicall_entry_t))
-int unmap_frames(unsigned long va, unsigned long num_frames)
+static int clear_frames(unsigned long va, unsigned long num_frames)
 {
 #ifdef CONFIG_PARAVIRT
     int n = UNMAP_BATCH;
@@ -778,9 +898,22 @@ int unmap_frames(unsigned long va, unsigned long num_frames)
         num_frames -= n;
 #else
         pgt = get_pgt(va);
+        if ( pgt && (*pgt & _PAGE_PSE) )
+        {
+            if ( !(va & L1_MASK) && num_frames >= L1_PAGETABLE_ENTRIES )
+            {
+                *pgt = 0;
+                invlpg(va);
+                va += 1UL << L2_PAGETABLE_SHIFT;
+                num_frames -= L1_PAGETABLE_ENTRIES;
+                continue;
+            }
+            pgt = split_superpage(va, pgt);
+            if ( !pgt )
+                return -ENOMEM;
+        }
         if ( pgt )
         {
-            ASSERT(!(*pgt & _PAGE_PSE));
             *pgt = 0;
             invlpg(va);
         }
@@ -791,6 +924,19 @@ int unmap_frames(unsigned long va, unsigned long num_frames)
     return 0;
 }
 
+/*
+ * Unmap num_frames frames mapped at virtual address va. Pages in the
+ * demand map area become free for allocate_ondemand() again.
+ */
+int unmap_frames(unsigned long va, unsigned long num_frames)
+{
+    int rc = clear_frames(va, num_frames);
+
+    if ( !rc )
+        free_ondemand(va, num_frames);
+    return rc;
+}
+
 /*
  * Clear some of the bootstrap memory
  */
@@ -890,19 +1036,99 @@ void arch_init_mm(unsigned long* start_pfn_p, unsigned long* max_pfn_p)
 #endif
 }
 
-grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames)
+/*
+ * Extend the grant table mapped at table from old_frames to
+ * nr_grant_frames frames. The added frames replace the zero page
+ * mappings arch_init_gnttab() reserved the address space with.
+ */
+int arch_grow_gnttab(grant_entry_v1_t *table, int old_frames,
+                     int nr_grant_frames)
 {
     struct gnttab_setup_table setup;
     unsigned long frames[nr_grant_frames];
+    unsigned long va = (unsigned long)table + old_frames * PAGE_SIZE;
+    int rc;
 
     setup.dom = DOMID_SELF;
     setup.nr_frames = nr_grant_frames;
     set_xen_guest_handle(setup.frame_list, frames);
 
-    HYPERVISOR_grant_table_op(GNTTABOP_setup_table, &setup, 1);
-    return map_frames(frames, nr_grant_frames);
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_setup_table, &setup, 1);
+    if ( rc || setup.status != GNTST_okay )
+    {
+        printk("GNTTABOP_setup_table(%d) failed: %d %d\n",
+               nr_grant_frames, rc, setup.status);
+        return -ENOMEM;
+    }
+
+    clear_frames(va, nr_grant_frames - old_frames);
+    return do_map_frames(va, frames + old_frames,
+                         nr_grant_frames - old_frames, 1, 0, DOMID_SELF,
+                         NULL, L1_PROT);
 }
 
+grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames, int max_grant_frames)
+{
+    grant_entry_v1_t *table;
+
+    /* Keep virtual space for the largest table Xen will give us. */
+    table = map_zero(max_grant_frames, 1);
+    if ( !table || arch_grow_gnttab(table, 0, nr_grant_frames) )
+    {
+        printk("Failed to map grant table\n");
+        do_exit();
+    }
+    return table;
+}
+
+#if __XEN_INTERFACE_VERSION__ >= 0x0003020a
+/* Map status frames of a version 2 grant table, as for the table itself. */
+int arch_grow_gnttab_status(grant_status_t *status, int old_frames,
+                            int nr_status_frames)
+{
+    struct gnttab_get_status_frames getframes;
+    uint64_t gframes[nr_status_frames];
+    unsigned long frames[nr_status_frames];
+    unsigned long va = (unsigned long)status + old_frames * PAGE_SIZE;
+    int i, rc;
+
+    getframes.dom = DOMID_SELF;
+    getframes.nr_frames = nr_status_frames;
+    set_xen_guest_handle(getframes.frame_list, gframes);
+
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_get_status_frames, &getframes, 1);
+    if ( rc || getframes.status != GNTST_okay )
+    {
+        printk("GNTTABOP_get_status_frames(%d) failed: %d %d\n",
+               nr_status_frames, rc, getframes.status);
+        return -ENOMEM;
+    }
+    for ( i = 0; i < nr_status_frames; i++ )
+        frames[i] = gframes[i];
+
+    clear_frames(va, nr_status_frames - old_frames);
+    return do_map_frames(va, frames + old_frames,
+                         nr_status_frames - old_frames, 1, 0, DOMID_SELF,
+                         NULL, L1_PROT_RO);
+}
+
+grant_status_t *arch_init_gnttab_status(int nr_status_frames,
+                                        int max_status_frames)
+{
+    grant_status_t *status;
+
+    status = map_zero(max_status_frames, 1);
+    if ( !status )
+        return NULL;
+    if ( arch_grow_gnttab_status(status, 0, nr_status_frames) )
+    {
+        unmap_frames((unsigned long)status, max_status_frames);
+        return NULL;
+    }
+    return status;
+}
+#endif
+
 unsigned long alloc_virt_kernel(unsigned n_pages)
 {
     unsigned long addr;
@@ -25,12 +25,22 @@
 #include <mini-os/balloon.h>
 #include <mini-os/errno.h>
 #include <mini-os/lib.h>
+#include <mini-os/memtag.h>
+#include <mini-os/mm.h>
 #include <mini-os/paravirt.h>
+#include <mini-os/sched.h>
+#include <mini-os/wait.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/xmalloc.h>
 #include <xen/xen.h>
 #include <xen/memory.h>
 
 unsigned long nr_max_pages;
 unsigned long nr_mem_pages;
+/* Pages given back by balloon_down() and not repopulated yet. */
+unsigned long nr_ballooned_pages;
+/* memory/target in pages, or 0 as long as it has not been read. */
+unsigned long balloon_target;
 
 void get_max_pages(void)
 {
@@ -68,6 +78,67 @@ void mm_alloc_bitmap_remap(void)
 #define N_BALLOON_FRAMES 64
 static unsigned long balloon_frames[N_BALLOON_FRAMES];
 
+/*
+ * Pfns of ballooned out pages, which balloon_up() repopulates before it
+ * grows the domain beyond nr_mem_pages. The list is kept in pages of
+ * its own, newest first.
+ */
+#define BALLOON_LIST_ENTRIES (PAGE_SIZE / sizeof(unsigned long) - 2)
+
+struct balloon_list {
+    struct balloon_list *next;
+    unsigned long nr;
+    unsigned long pfn[BALLOON_LIST_ENTRIES];
+};
+
+static struct balloon_list *ballooned;
+static int in_balloon;
+
+/* Pages the domain holds right now. */
+static inline unsigned long balloon_current(void)
+{
+    return nr_mem_pages - nr_ballooned_pages;
+}
+
+static int balloon_refill(unsigned long n_pages)
+{
+    struct balloon_list *l = ballooned;
+    unsigned long i, pfn;
+    int rc;
+    struct xen_memory_reservation reservation = {
+        .domid        = DOMID_SELF
+    };
+
+    if ( n_pages > l->nr )
+        n_pages = l->nr;
+
+    /* Take pfns from the end of the list, so it just gets shorter. */
+    for ( i = 0; i < n_pages; i++ )
+        balloon_frames[i] = l->pfn[l->nr - 1 - i];
+    set_xen_guest_handle(reservation.extent_start, balloon_frames);
+    reservation.nr_extents = n_pages;
+    rc = HYPERVISOR_memory_op(XENMEM_populate_physmap, &reservation);
+    if ( rc <= 0 )
+        return rc;
+
+    for ( i = 0; i < rc; i++ )
+    {
+        pfn = l->pfn[l->nr - 1 - i];
+        arch_pfn_add(pfn, balloon_frames[i]);
+        free_page(pfn_to_virt(pfn));
+    }
+
+    l->nr -= rc;
+    nr_ballooned_pages -= rc;
+    if ( l->nr == 0 )
+    {
+        ballooned = l->next;
+        free_page(l);
+    }
+
+    return rc;
+}
+
 int balloon_up(unsigned long n_pages)
 {
     unsigned long page, pfn;
@@ -76,6 +147,19 @@ int balloon_up(unsigned long n_pages)
         .domid        = DOMID_SELF
     };
 
+    if ( balloon_target )
+    {
+        if ( balloon_current() >= balloon_target )
+            return 0;
+        if ( n_pages > balloon_target - balloon_current() )
+            n_pages = balloon_target - balloon_current();
+    }
+    if ( n_pages > N_BALLOON_FRAMES )
+        n_pages = N_BALLOON_FRAMES;
+
+    if ( ballooned )
+        return balloon_refill(n_pages);
+
     if ( n_pages > nr_max_pages - nr_mem_pages )
         n_pages = nr_max_pages - nr_mem_pages;
     if ( n_pages > N_BALLOON_FRAMES )
@@ -125,7 +209,75 @@ int balloon_up(unsigned long n_pages)
     return rc;
 }
 
-static int in_balloon;
+/*
+ * Give up to n_pages free pages back to Xen. Returns the number of
+ * pages released or a negative error.
+ */
+int balloon_down(unsigned long n_pages)
+{
+    struct balloon_list *l = ballooned;
+    unsigned long va, pfn, i, n;
+    int rc;
+
+    if ( in_balloon )
+        return 0;
+    if ( n_pages > N_BALLOON_FRAMES )
+        n_pages = N_BALLOON_FRAMES;
+
+    /* Allocations below must not balloon up again. */
+    in_balloon = 1;
+
+    if ( l == NULL || l->nr == BALLOON_LIST_ENTRIES )
+    {
+        l = (struct balloon_list *)alloc_page();
+        if ( l == NULL )
+        {
+            in_balloon = 0;
+            return -ENOMEM;
+        }
+        l->next = ballooned;
+        l->nr = 0;
+        ballooned = l;
+    }
+    if ( n_pages > BALLOON_LIST_ENTRIES - l->nr )
+        n_pages = BALLOON_LIST_ENTRIES - l->nr;
+
+    /* Pages handed to Xen are not ours to account for. */
+    for ( n = 0; n < n_pages; n++ )
+    {
+        va = alloc_pages_tag(0, MEM_TAG_NONE);
+        if ( !va )
+            break;
+        pfn = virt_to_pfn(va);
+        balloon_frames[n] = virt_to_mfn(va);
+        l->pfn[l->nr + n] = pfn;
+        arch_pfn_remove(pfn);
+    }
+
+    rc = n ? free_physical_pages(balloon_frames, n) : 0;
+    if ( rc < 0 )
+        rc = 0;
+
+    /* Whatever Xen did not take goes back to the page allocator. */
+    for ( i = rc; i < n; i++ )
+    {
+        pfn = l->pfn[l->nr + i];
+        arch_pfn_add(pfn, balloon_frames[i]);
+        free_page(pfn_to_virt(pfn));
+    }
+
+    l->nr += rc;
+    nr_ballooned_pages += rc;
+    if ( l->nr == 0 )
+    {
+        ballooned = l->next;
+        free_page(l);
+    }
+
+    in_balloon = 0;
+
+    return rc;
+}
 
 int chk_free_pages(unsigned long needed)
 {
@@ -156,3 +308,100 @@ int chk_free_pages(unsigned long needed)
 
     return needed <= nr_free_pages;
 }
+
+#ifdef CONFIG_XENBUS
+/*
+ * Background policy: once per BALLOON_PERIOD, or when the toolstack
+ * changes memory/target, give back whatever the domain holds above
+ * memory/target and whatever free memory stayed above the headroom for
+ * the whole period. balloon_up() then grows the domain again on demand,
+ * but never beyond memory/target.
+ */
+#define BALLOON_PERIOD  SECONDS(5)
+
+static unsigned long balloon_headroom = BALLOON_HEADROOM_PAGES;
+
+void balloon_set_headroom(unsigned long pages)
+{
+    balloon_headroom = pages;
+}
+
+static void balloon_read_target(void)
+{
+    int target = xenbus_read_integer("memory/target");
+
+    /* memory/target is in KiB. */
+    if ( target > 0 )
+        balloon_target = (unsigned long)target >> (PAGE_SHIFT - 10);
+}
+
+static void balloon_thread(void *p)
+{
+    xenbus_event_queue events = NULL;
+    unsigned long free_prev = nr_free_pages, idle, excess, limit, released;
+    unsigned long keep, reported = 0;
+    s_time_t deadline;
+    char *err;
+    int rc;
+
+    err = xenbus_watch_path_token(XBT_NIL, "memory/target", "balloon",
+                                  &events);
+    free(err);
+
+    for ( ;; )
+    {
+        balloon_read_target();
+
+        excess = 0;
+        if ( balloon_target && balloon_current() > balloon_target )
+            excess = balloon_current() - balloon_target;
+        idle = free_prev < nr_free_pages ? free_prev : nr_free_pages;
+        if ( idle > balloon_headroom && idle - balloon_headroom > excess )
+            excess = idle - balloon_headroom;
+        /*
+         * Never push free memory below the allocator's high watermark:
+         * the next allocation would cross the low one and run every
+         * shrinker. A domain still over target is reported instead.
+         */
+        keep = mm_high_watermark();
+        if ( keep < BALLOON_EMERGENCY_PAGES )
+            keep = BALLOON_EMERGENCY_PAGES;
+        limit = nr_free_pages > keep ? nr_free_pages - keep : 0;
+        if ( excess > limit )
+            excess = limit;
+
+        for ( released = 0; released < excess; released += rc )
+        {
+            rc = balloon_down(excess - released);
+            if ( rc <= 0 )
+                break;
+        }
+        if ( released )
+            printk("Balloon: returned %lu pages, %lu pages held, target %lu\n",
+                   released, balloon_current(), balloon_target);
+        if ( balloon_target && balloon_current() > balloon_target )
+        {
+            if ( balloon_current() != reported )
+                printk("Balloon: %lu pages held, over target %lu, "
+                       "%lu pages free\n", balloon_current(), balloon_target,
+                       nr_free_pages);
+            reported = balloon_current();
+        }
+        else
+            reported = 0;
+
+        free_prev = nr_free_pages;
+        deadline = NOW() + BALLOON_PERIOD;
+        wait_event_deadline(xenbus_watch_queue, events != NULL, deadline);
+        while ( events != NULL )
+            xenbus_wait_for_watch(&events);
+    }
+}
+#endif
+
+void init_balloon(void)
+{
+#ifdef CONFIG_XENBUS
+    create_thread("balloon", balloon_thread, NULL);
+#endif
+}
@@ -0,0 +1,206 @@
+/*
+ * Batched GNTTABOP_copy.
+ *
+ * Copying into or out of a peer's granted pages with GNTTABOP_copy
+ * avoids mapping them. Segments are queued in a struct gntcopy and sent
+ * to Xen GNTCOPY_BATCH at a time; each segment may carry a pointer that
+ * receives its GNTST_* status once it has been submitted.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/gntcopy.h>
+#include <errno.h>
+#include <inttypes.h>
+
+//#define GNTCOPY_DEBUG
+#ifdef GNTCOPY_DEBUG
+#define DEBUG(_f, _a...) \
+    printk("MINI_OS(gntcopy.c:%d): %s" _f "\n", __LINE__, __func__, ## _a)
+#else
+#define DEBUG(_f, _a...)    ((void)0)
+#endif
+
+void
+gntcopy_init(struct gntcopy *c)
+{
+    c->nr = 0;
+    c->failed = 0;
+}
+
+/*
+ * Send the queued segments to Xen and add the ones that failed to
+ * c->failed. If the hypercall itself fails, every queued segment counts
+ * as failed, its status is set to GNTST_general_error and the negative
+ * error is returned.
+ */
+static int
+gntcopy_submit(struct gntcopy *c)
+{
+    int i, rc;
+
+    DEBUG("(c=%p, nr=%d)", c, c->nr);
+
+    if (c->nr == 0)
+        return 0;
+
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_copy, c->op, c->nr);
+    if (rc != 0) {
+        printk("GNTTABOP_copy failed: returned %d\n", rc);
+        for (i = 0; i < c->nr; i++)
+            if (c->status[i])
+                *c->status[i] = GNTST_general_error;
+        c->failed += c->nr;
+        c->nr = 0;
+        return rc < 0 ? rc : -EIO;
+    }
+    for (i = 0; i < c->nr; i++) {
+        if (c->op[i].status != GNTST_okay) {
+            DEBUG("segment %d failed: %" PRId16, i, c->op[i].status);
+            c->failed++;
+        }
+        if (c->status[i])
+            *c->status[i] = c->op[i].status;
+    }
+    c->nr = 0;
+    return 0;
+}
+
+/*
+ * Submit the queued segments. Returns the number of segments that
+ * failed since the last successful flush, or a negative error if the
+ * hypercall itself failed. In that case the failed segments stay
+ * counted and are included in what the next flush returns.
+ */
+int
+gntcopy_flush(struct gntcopy *c)
+{
+    int rc, failed;
+
+    rc = gntcopy_submit(c);
+    if (rc < 0)
+        return rc;
+
+    failed = c->failed;
+    c->failed = 0;
+    return failed;
+}
+
+static void
+gntcopy_set_ptr(gnttab_copy_t *op, int is_source, const struct gntcopy_ptr *p)
+{
+    if (is_source) {
+        op->source.domid = p->ref == GNTCOPY_LOCAL ? DOMID_SELF : p->domid;
+        op->source.offset = p->offset;
+        if (p->ref == GNTCOPY_LOCAL) {
+            op->source.u.gmfn = p->frame;
+        } else {
+            op->source.u.ref = p->ref;
+            op->flags |= GNTCOPY_source_gref;
+        }
+    } else {
+        op->dest.domid = p->ref == GNTCOPY_LOCAL ? DOMID_SELF : p->domid;
+        op->dest.offset = p->offset;
+        if (p->ref == GNTCOPY_LOCAL) {
+            op->dest.u.gmfn = p->frame;
+        } else {
+            op->dest.u.ref = p->ref;
+            op->flags |= GNTCOPY_dest_gref;
+        }
+    }
+}
+
+/*
+ * Queue a copy of len bytes from src to dst, neither of which may cross
+ * a page boundary. A full batch is flushed first; segments failing in
+ * such an intermediate flush are counted in the next gntcopy_flush().
+ */
+int
+gntcopy_add(struct gntcopy *c, const struct gntcopy_ptr *src,
+            const struct gntcopy_ptr *dst, uint16_t len, int16_t *status)
+{
+    gnttab_copy_t *op;
+    int rc;
+
+    if (len == 0 || src->offset + len > PAGE_SIZE ||
+        dst->offset + len > PAGE_SIZE)
+        return -EINVAL;
+
+    if (c->nr == GNTCOPY_BATCH) {
+        rc = gntcopy_submit(c);
+        if (rc < 0)
+            return rc;
+    }
+
+    op = &c->op[c->nr];
+    op->flags = 0;
+    op->len = len;
+    gntcopy_set_ptr(op, 1, src);
+    gntcopy_set_ptr(op, 0, dst);
+    c->status[c->nr++] = status;
+    return 0;
+}
+
+/*
+ * Queue a copy between a local buffer and a peer's granted page,
+ * splitting it where the buffer crosses page boundaries. status, if
+ * given, receives the status of the first piece; failures of the others
+ * are only counted by gntcopy_flush().
+ */
+static int
+gntcopy_local(struct gntcopy *c, unsigned long va, domid_t domid,
+              grant_ref_t ref, uint16_t offset, size_t len,
+              int16_t *status, int to_ref)
+{
+    struct gntcopy_ptr local, foreign;
+    size_t chunk;
+    int rc;
+
+    if (offset + len > PAGE_SIZE)
+        return -EINVAL;
+
+    foreign.ref = ref;
+    foreign.domid = domid;
+    foreign.offset = offset;
+    local.ref = GNTCOPY_LOCAL;
+
+    while (len > 0) {
+        local.frame = virt_to_mfn(va);
+        local.offset = va & ~PAGE_MASK;
+        chunk = PAGE_SIZE - local.offset;
+        if (chunk > len)
+            chunk = len;
+
+        if (to_ref)
+            rc = gntcopy_add(c, &local, &foreign, chunk, status);
+        else
+            rc = gntcopy_add(c, &foreign, &local, chunk, status);
+        if (rc)
+            return rc;
+
+        /* Later pieces are only counted by gntcopy_flush(). */
+        status = NULL;
+        va += chunk;
+        foreign.offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+int
+gntcopy_to_ref(struct gntcopy *c, domid_t domid, grant_ref_t ref,
+               uint16_t offset, const void *buf, size_t len,
+               int16_t *status)
+{
+    return gntcopy_local(c, (unsigned long)buf, domid, ref, offset, len,
+                         status, 1);
+}
+
+int
+gntcopy_from_ref(struct gntcopy *c, void *buf, domid_t domid,
+                 grant_ref_t ref, uint16_t offset, size_t len,
+                 int16_t *status)
+{
+    return gntcopy_local(c, (unsigned long)buf, domid, ref, offset, len,
+                         status, 0);
+}
@@ -7,8 +7,9 @@
  * (host address, grant handle) pairs. Grant handles come from a hypervisor map
  * operation and are needed for the corresponding unmap.
  *
- * This is a rather naive implementation in terms of performance. If we start
- * using it frequently, there's definitely some low-hanging fruit here.
+ * Free entries are kept on a list and mapped ones are indexed by host
+ * address, so map and unmap bookkeeping does not depend on the number of
+ * grants mapped. The array grows as needed.
  *
  *
  * Permission is hereby granted, free of charge, to any person obtaining a copy
@@ -49,9 +50,38 @@
 
 #define DEFAULT_MAX_GRANTS 128
 
+/*
+ * Unused entries are chained on a free list through next; mapped ones
+ * hang off a hash of their host address, also chained through next.
+ *
+ * Entries held by the persistent mapping cache are also hashed by
+ * (domid, ref) through cnext, and sit on the LRU list through
+ * lru_prev/lru_next while nobody uses them.
+ */
 struct gntmap_entry {
     unsigned long host_addr;
     grant_handle_t handle;
+    int next;
+    int cached;
+    int users;
+    uint32_t domid;
+    uint32_t ref;
+    int writable;
+    int cnext;
+    int lru_prev;
+    int lru_next;
+};
+
+struct gntmap_cache {
+    int max_cached;
+    int ncached;
+    int nbuckets;
+    int *buckets;
+    /* Idle cached entries, most recently used at the head. */
+    int lru_head;
+    int lru_tail;
+    unsigned long hits;
+    unsigned long misses;
 };
 
 static inline int
@@ -60,124 +90,458 @@ gntmap_entry_used(struct gntmap_entry *entry)
     return entry->host_addr != 0;
 }
 
+static inline int
+gntmap_hash(struct gntmap *map, unsigned long addr)
+{
+    return (addr >> PAGE_SHIFT) & (map->nbuckets - 1);
+}
+
 static struct gntmap_entry*
-gntmap_find_free_entry(struct gntmap *map)
+gntmap_find_entry(struct gntmap *map, unsigned long addr)
 {
     int i;
 
-    for (i = 0; i < map->nentries; i++) {
-        if (!gntmap_entry_used(&map->entries[i]))
+    if (map->nbuckets == 0)
+        return NULL;
+    for (i = map->buckets[gntmap_hash(map, addr)]; i >= 0;
+         i = map->entries[i].next) {
+        if (map->entries[i].host_addr == addr)
             return &map->entries[i];
     }
-
-    DEBUG("(map=%p): all %d entries full",
-           map, map->nentries);
     return NULL;
 }
 
+static void
+gntmap_index_entry(struct gntmap *map, struct gntmap_entry *ent)
+{
+    int *bucket = &map->buckets[gntmap_hash(map, ent->host_addr)];
+
+    ent->next = *bucket;
+    *bucket = ent - map->entries;
+}
+
+static void
+gntmap_unindex_entry(struct gntmap *map, struct gntmap_entry *ent)
+{
+    int *link = &map->buckets[gntmap_hash(map, ent->host_addr)];
+
+    while (&map->entries[*link] != ent)
+        link = &map->entries[*link].next;
+    *link = ent->next;
+}
+
 static struct gntmap_entry*
-gntmap_find_entry(struct gntmap *map, unsigned long addr)
+gntmap_get_free_entry(struct gntmap *map)
 {
-    int i;
+    struct gntmap_entry *ent;
 
-    for (i = 0; i < map->nentries; i++) {
-        if (map->entries[i].host_addr == addr)
-            return &map->entries[i];
+    if (map->free < 0)
+        return NULL;
+    ent = &map->entries[map->free];
+    map->free = ent->next;
+    map->nused++;
+    return ent;
+}
+
+static void
+gntmap_put_free_entry(struct gntmap *map, struct gntmap_entry *ent)
+{
+    ent->host_addr = 0;
+    ent->next = map->free;
+    map->free = ent - map->entries;
+    map->nused--;
+}
+
+/*
+ * Grow the map to hold count entries. The hash gets at least as many
+ * buckets as there are entries, so chains stay short.
+ */
+static int
+gntmap_grow(struct gntmap *map, int count)
+{
+    struct gntmap_entry *entries;
+    int *buckets;
+    int i, nbuckets;
+
+    if (count <= map->nentries)
+        return 0;
+
+    for (nbuckets = 1; nbuckets < count; nbuckets <<= 1)
+        ;
+    entries = xmalloc_array(struct gntmap_entry, count);
+    buckets = xmalloc_array(int, nbuckets);
+    if (entries == NULL || buckets == NULL) {
+        xfree(entries);
+        xfree(buckets);
+        return -ENOMEM;
     }
-    return NULL;
+
+    /* A zeroed map, never passed to gntmap_init(), is empty as well. */
+    if (map->nentries == 0)
+        map->free = -1;
+    memcpy(entries, map->entries, sizeof(*entries) * map->nentries);
+    memset(entries + map->nentries, 0,
+           sizeof(*entries) * (count - map->nentries));
+    for (i = count - 1; i >= map->nentries; i--) {
+        entries[i].next = map->free;
+        map->free = i;
+    }
+    xfree(map->entries);
+    xfree(map->buckets);
+    map->entries = entries;
+    map->nentries = count;
+    map->buckets = buckets;
+    map->nbuckets = nbuckets;
+
+    /* Rehash the mapped entries into the new buckets. */
+    for (i = 0; i < nbuckets; i++)
+        buckets[i] = -1;
+    for (i = 0; i < map->nentries; i++)
+        if (gntmap_entry_used(&entries[i]))
+            gntmap_index_entry(map, &entries[i]);
+
+    return 0;
 }
 
+/* Make sure count more entries can be taken, doubling the map if not. */
+static int
+gntmap_reserve(struct gntmap *map, int count)
+{
+    int want = map->nused + count, size;
+
+    if (want <= map->nentries)
+        return 0;
+    size = map->nentries ? map->nentries : DEFAULT_MAX_GRANTS;
+    while (size < want)
+        size <<= 1;
+    return gntmap_grow(map, size);
+}
+
+/*
+ * Size the map for count grants up front. The map grows on demand, so
+ * this is only a hint; it never shrinks the map.
+ */
 int
 gntmap_set_max_grants(struct gntmap *map, int count)
 {
     DEBUG("(map=%p, count=%d)", map, count);
 
-    if (map->nentries != 0)
-        return -EBUSY;
+    return gntmap_grow(map, count);
+}
 
-    map->entries = xmalloc_array(struct gntmap_entry, count);
-    if (map->entries == NULL)
-        return -ENOMEM;
+/* Map and unmap operations are submitted this many at a time. */
+#define GNTMAP_BATCH 32
 
-    memset(map->entries, 0, sizeof(struct gntmap_entry) * count);
-    map->nentries = count;
-    return 0;
+/*
+ * Map refs[i] of domids[i * domids_stride] at host_addr + i pages for
+ * i < n, with a single hypercall. Entries whose operation succeeded are
+ * filled in even if others failed; the first failure is returned.
+ */
+static int
+_gntmap_map_grant_refs(struct gntmap *map,
+                       struct gntmap_entry **ents, int n,
+                       unsigned long host_addr,
+                       uint32_t *domids,
+                       int domids_stride,
+                       uint32_t *refs,
+                       int writable)
+{
+    struct gnttab_map_grant_ref op[GNTMAP_BATCH];
+    int i, rc, err = 0;
+
+    BUG_ON(n > GNTMAP_BATCH);
+    for (i = 0; i < n; i++) {
+        op[i].ref = (grant_ref_t) refs[i];
+        op[i].dom = (domid_t) domids[i * domids_stride];
+        op[i].host_addr = (uint64_t) (host_addr + PAGE_SIZE * i);
+        op[i].flags = GNTMAP_host_map;
+        if (!writable)
+            op[i].flags |= GNTMAP_readonly;
+    }
+
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, op, n);
+    if (rc != 0) {
+        printk("GNTTABOP_map_grant_ref failed: returned %d\n", rc);
+        for (i = 0; i < n; i++)
+            gntmap_put_free_entry(map, ents[i]);
+        return rc;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (op[i].status != GNTST_okay) {
+            printk("GNTTABOP_map_grant_ref failed: "
+                   "ref %" PRIu32 " status %" PRId16 "\n",
+                   refs[i], op[i].status);
+            if (err == 0)
+                err = op[i].status;
+            gntmap_put_free_entry(map, ents[i]);
+            continue;
+        }
+        ents[i]->host_addr = host_addr + PAGE_SIZE * i;
+        ents[i]->handle = op[i].handle;
+        gntmap_index_entry(map, ents[i]);
+    }
+    return err;
 }
 
+/* Unmap n entries with a single hypercall, returning the first failure. */
 static int
-_gntmap_map_grant_ref(struct gntmap_entry *entry, 
-                      unsigned long host_addr,
-                      uint32_t domid,
-                      uint32_t ref,
-                      int writable)
+_gntmap_unmap_grant_refs(struct gntmap *map, struct gntmap_entry **ents, int n)
 {
-    struct gnttab_map_grant_ref op;
-    int rc;
+    struct gnttab_unmap_grant_ref op[GNTMAP_BATCH];
+    int i, rc, err = 0;
+
+    BUG_ON(n > GNTMAP_BATCH);
+    if (n == 0)
+        return 0;
+    for (i = 0; i < n; i++) {
+        op[i].host_addr    = (uint64_t) ents[i]->host_addr;
+        op[i].dev_bus_addr = 0;
+        op[i].handle       = ents[i]->handle;
+    }
 
-    op.ref = (grant_ref_t) ref;
-    op.dom = (domid_t) domid;
-    op.host_addr = (uint64_t) host_addr;
-    op.flags = GNTMAP_host_map;
-    if (!writable)
-        op.flags |= GNTMAP_readonly;
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, op, n);
+    if (rc != 0) {
+        printk("GNTTABOP_unmap_grant_ref failed: returned %d\n", rc);
+        return rc;
+    }
 
-    rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &op, 1);
-    if (rc != 0 || op.status != GNTST_okay) {
-        printk("GNTTABOP_map_grant_ref failed: "
-               "returned %d, status %" PRId16 "\n",
-               rc, op.status);
-        return rc != 0 ? rc : op.status;
+    for (i = 0; i < n; i++) {
+        if (op[i].status != GNTST_okay) {
+            printk("GNTTABOP_unmap_grant_ref failed: "
+                   "status %" PRId16 "\n", op[i].status);
+            if (err == 0)
+                err = op[i].status;
+            continue;
+        }
+        gntmap_unindex_entry(map, ents[i]);
+        free_ondemand(ents[i]->host_addr, 1);
+        gntmap_put_free_entry(map, ents[i]);
     }
+    return err;
+}
 
-    entry->host_addr = host_addr;
-    entry->handle = op.handle;
-    return 0;
+static inline int
+gntmap_cache_hash(struct gntmap_cache *cache, uint32_t domid, uint32_t ref)
+{
+    return (ref ^ (domid << 16)) & (cache->nbuckets - 1);
+}
+
+static struct gntmap_entry*
+gntmap_cache_lookup(struct gntmap *map, uint32_t domid, uint32_t ref,
+                    int writable)
+{
+    struct gntmap_cache *cache = map->cache;
+    struct gntmap_entry *ent;
+    int i;
+
+    for (i = cache->buckets[gntmap_cache_hash(cache, domid, ref)]; i >= 0;
+         i = ent->cnext) {
+        ent = &map->entries[i];
+        if (ent->domid == domid && ent->ref == ref &&
+            ent->writable == writable)
+            return ent;
+    }
+    return NULL;
+}
+
+static void
+gntmap_lru_remove(struct gntmap *map, struct gntmap_entry *ent)
+{
+    struct gntmap_cache *cache = map->cache;
+
+    if (ent->lru_prev >= 0)
+        map->entries[ent->lru_prev].lru_next = ent->lru_next;
+    else
+        cache->lru_head = ent->lru_next;
+    if (ent->lru_next >= 0)
+        map->entries[ent->lru_next].lru_prev = ent->lru_prev;
+    else
+        cache->lru_tail = ent->lru_prev;
 }
 
+static void
+gntmap_lru_push(struct gntmap *map, struct gntmap_entry *ent)
+{
+    struct gntmap_cache *cache = map->cache;
+    int i = ent - map->entries;
+
+    ent->lru_prev = -1;
+    ent->lru_next = cache->lru_head;
+    if (cache->lru_head >= 0)
+        map->entries[cache->lru_head].lru_prev = i;
+    else
+        cache->lru_tail = i;
+    cache->lru_head = i;
+}
+
+/* Drop ent from the cache; it stays mapped as an ordinary entry. */
+static void
+gntmap_cache_forget(struct gntmap *map, struct gntmap_entry *ent)
+{
+    struct gntmap_cache *cache = map->cache;
+    int *link = &cache->buckets[gntmap_cache_hash(cache, ent->domid,
+                                                  ent->ref)];
+
+    while (&map->entries[*link] != ent)
+        link = &map->entries[*link].cnext;
+    *link = ent->cnext;
+    if (ent->users == 0)
+        gntmap_lru_remove(map, ent);
+    ent->cached = 0;
+    cache->ncached--;
+}
+
+/* Unmap the least recently used idle mapping, if there is one. */
 static int
-_gntmap_unmap_grant_ref(struct gntmap_entry *entry)
+gntmap_cache_evict(struct gntmap *map)
 {
-    struct gnttab_unmap_grant_ref op;
-    int rc;
+    struct gntmap_entry *ent;
 
-    op.host_addr    = (uint64_t) entry->host_addr;
-    op.dev_bus_addr = 0;
-    op.handle       = entry->handle;
+    if (map->cache->lru_tail < 0)
+        return -ENOENT;
+    ent = &map->entries[map->cache->lru_tail];
+    gntmap_cache_forget(map, ent);
+    return _gntmap_unmap_grant_refs(map, &ent, 1);
+}
 
-    rc = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &op, 1);
-    if (rc != 0 || op.status != GNTST_okay) {
-        printk("GNTTABOP_unmap_grant_ref failed: "
-               "returned %d, status %" PRId16 "\n",
-               rc, op.status);
-        return rc != 0 ? rc : op.status;
+static void
+gntmap_cache_insert(struct gntmap *map, unsigned long addr, uint32_t domid,
+                    uint32_t ref, int writable)
+{
+    struct gntmap_cache *cache = map->cache;
+    struct gntmap_entry *ent = gntmap_find_entry(map, addr);
+    int *bucket;
+
+    if (cache->ncached == cache->max_cached && gntmap_cache_evict(map) != 0)
+        return;
+
+    ent->cached = 1;
+    ent->users = 1;
+    ent->domid = domid;
+    ent->ref = ref;
+    ent->writable = writable;
+    bucket = &cache->buckets[gntmap_cache_hash(cache, domid, ref)];
+    ent->cnext = *bucket;
+    *bucket = ent - map->entries;
+    cache->ncached++;
+}
+
+/*
+ * Keep up to max_cached single-page mappings alive after they are
+ * unmapped, so that mapping the same (domid, ref) again returns the old
+ * address without a hypercall. The least recently used idle mapping is
+ * torn down when the cache is full. The peer cannot end access to a
+ * grant while we keep it mapped, so this is only for grants that it
+ * agrees to leave in place. 0 disables the cache and releases every
+ * idle mapping.
+ */
+int
+gntmap_set_cache(struct gntmap *map, int max_cached)
+{
+    struct gntmap_cache *cache = map->cache;
+    int i, nbuckets;
+
+    DEBUG("(map=%p, max_cached=%d)", map, max_cached);
+
+    if (max_cached < 0)
+        return -EINVAL;
+
+    if (cache != NULL) {
+        while (cache->ncached > max_cached && gntmap_cache_evict(map) == 0)
+            ;
+        if (max_cached == 0) {
+            for (i = 0; i < map->nentries; i++)
+                if (map->entries[i].cached)
+                    gntmap_cache_forget(map, &map->entries[i]);
+            xfree(cache->buckets);
+            xfree(cache);
+            map->cache = NULL;
+            return 0;
+        }
+        /* The buckets stay as they are; chains just get longer. */
+        cache->max_cached = max_cached;
+        return 0;
     }
+    if (max_cached == 0)
+        return 0;
 
-    entry->host_addr = 0;
+    for (nbuckets = 1; nbuckets < max_cached; nbuckets <<= 1)
+        ;
+    cache = xmalloc(struct gntmap_cache);
+    if (cache == NULL)
+        return -ENOMEM;
+    cache->buckets = xmalloc_array(int, nbuckets);
+    if (cache->buckets == NULL) {
+        xfree(cache);
+        return -ENOMEM;
+    }
+    for (i = 0; i < nbuckets; i++)
+        cache->buckets[i] = -1;
+    cache->nbuckets = nbuckets;
+    cache->max_cached = max_cached;
+    cache->ncached = 0;
+    cache->lru_head = cache->lru_tail = -1;
+    cache->hits = cache->misses = 0;
+    map->cache = cache;
     return 0;
 }
 
-int
-gntmap_munmap(struct gntmap *map, unsigned long start_address, int count)
+void
+gntmap_cache_stats(struct gntmap *map, unsigned long *hits,
+                   unsigned long *misses)
 {
-    int i, rc;
-    struct gntmap_entry *ent;
+    *hits = map->cache ? map->cache->hits : 0;
+    *misses = map->cache ? map->cache->misses : 0;
+}
 
-    DEBUG("(map=%p, start_address=%lx, count=%d)",
-           map, start_address, count);
+/*
+ * Unmap count pages from start_address. Unknown pages are an error if
+ * strict is set, and skipped otherwise.
+ */
+static int
+gntmap_unmap_range(struct gntmap *map, unsigned long start_address,
+                   int count, int strict)
+{
+    struct gntmap_entry *ents[GNTMAP_BATCH];
+    int i, n = 0, rc, err = 0;
 
     for (i = 0; i < count; i++) {
-        ent = gntmap_find_entry(map, start_address + PAGE_SIZE * i);
-        if (ent == NULL) {
+        ents[n] = gntmap_find_entry(map, start_address + PAGE_SIZE * i);
+        if (ents[n] == NULL) {
+            if (!strict)
+                continue;
             printk("gntmap: tried to munmap unknown page\n");
+            (void) _gntmap_unmap_grant_refs(map, ents, n);
             return -EINVAL;
         }
-
-        rc = _gntmap_unmap_grant_ref(ent);
-        if (rc != 0)
-            return rc;
+        if (ents[n]->cached) {
+            /* Keep the mapping for the next user of this grant. */
+            if (--ents[n]->users == 0)
+                gntmap_lru_push(map, ents[n]);
+            continue;
+        }
+        if (++n == GNTMAP_BATCH) {
+            rc = _gntmap_unmap_grant_refs(map, ents, n);
+            if (rc != 0 && err == 0)
+                err = rc;
+            n = 0;
+        }
     }
+    rc = _gntmap_unmap_grant_refs(map, ents, n);
+    if (rc != 0 && err == 0)
+        err = rc;
 
-    return 0;
+    return err;
+}
+
+int
+gntmap_munmap(struct gntmap *map, unsigned long start_address, int count)
+{
+    DEBUG("(map=%p, start_address=%lx, count=%d)",
+           map, start_address, count);
+
+    return gntmap_unmap_range(map, start_address, count, 1);
 }
 
 void*
@@ -189,7 +553,8 @@ gntmap_map_grant_refs(struct gntmap *map,
                       int writable)
 {
     unsigned long addr;
-    struct gntmap_entry *ent;
+    struct gntmap_entry *ents[GNTMAP_BATCH], *ent;
+    uint32_t done, n;
     int i;
 
     DEBUG("(map=%p, count=%" PRIu32 ", "
@@ -199,26 +564,45 @@ gntmap_map_grant_refs(struct gntmap *map,
            domids, domids == NULL ? 0 : domids[0], domids_stride,
            refs, refs == NULL ? 0 : refs[0], writable);
 
-    (void) gntmap_set_max_grants(map, DEFAULT_MAX_GRANTS);
+    writable = !!writable;
+    if (map->cache != NULL && count == 1) {
+        ent = gntmap_cache_lookup(map, domids[0], refs[0], writable);
+        if (ent != NULL) {
+            if (ent->users++ == 0)
+                gntmap_lru_remove(map, ent);
+            map->cache->hits++;
+            return (void*) ent->host_addr;
+        }
+        map->cache->misses++;
+    }
+
+    if (gntmap_reserve(map, count) != 0)
+        return NULL;
 
     addr = allocate_ondemand((unsigned long) count, 1);
     if (addr == 0)
         return NULL;
 
-    for (i = 0; i < count; i++) {
-        ent = gntmap_find_free_entry(map);
-        if (ent == NULL ||
-            _gntmap_map_grant_ref(ent,
-                                  addr + PAGE_SIZE * i,
-                                  domids[i * domids_stride],
-                                  refs[i],
-                                  writable) != 0) {
-
-            (void) gntmap_munmap(map, addr, i);
+    for (done = 0; done < count; done += n) {
+        n = count - done < GNTMAP_BATCH ? count - done : GNTMAP_BATCH;
+        for (i = 0; i < n; i++)
+            ents[i] = gntmap_get_free_entry(map);
+        if (_gntmap_map_grant_refs(map, ents, n, addr + PAGE_SIZE * done,
+                                   domids + done * domids_stride,
+                                   domids_stride, refs + done,
+                                   writable) != 0) {
+            /* Pages that never got mapped give their address back here. */
+            for (i = 0; i < count; i++)
+                if (gntmap_find_entry(map, addr + PAGE_SIZE * i) == NULL)
+                    free_ondemand(addr + PAGE_SIZE * i, 1);
+            (void) gntmap_unmap_range(map, addr, done + n, 0);
             return NULL;
         }
     }
 
+    if (map->cache != NULL && count == 1)
+        gntmap_cache_insert(map, addr, domids[0], refs[0], writable);
+
     return (void*) addr;
 }
 
@@ -228,6 +612,11 @@ gntmap_init(struct gntmap *map)
     DEBUG("(map=%p)", map);
     map->nentries = 0;
     map->entries = NULL;
+    map->nused = 0;
+    map->free = -1;
+    map->nbuckets = 0;
+    map->buckets = NULL;
+    map->cache = NULL;
 }
 
 void
@@ -238,13 +627,14 @@ gntmap_fini(struct gntmap *map)
 
     DEBUG("(map=%p)", map);
 
+    (void) gntmap_set_cache(map, 0);
     for (i = 0; i < map->nentries; i++) {
         ent = &map->entries[i];
         if (gntmap_entry_used(ent))
-            (void) _gntmap_unmap_grant_ref(ent);
+            (void) _gntmap_unmap_grant_refs(map, &ent, 1);
     }
 
     xfree(map->entries);
-    map->entries = NULL;
-    map->nentries = 0;
+    xfree(map->buckets);
+    gntmap_init(map);
 }
@@ -19,24 +19,198 @@
 #include <mini-os/mm.h>
 #include <mini-os/gnttab.h>
 #include <mini-os/semaphore.h>
+#include <mini-os/errno.h>
+#include <mini-os/hypervisor.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/time.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/memtag.h>
 
 #define NR_RESERVED_ENTRIES 8
 
-/* NR_GRANT_FRAMES must be less than or equal to that configured in Xen */
-#define NR_GRANT_FRAMES 256
-#define NR_GRANT_ENTRIES (NR_GRANT_FRAMES * PAGE_SIZE / sizeof(grant_entry_v1_t))
+/*
+ * The table starts with NR_GRANT_FRAMES_INIT frames and grows, at least
+ * that many frames at a time, up to the limit Xen reports for us.
+ */
+#define NR_GRANT_FRAMES_INIT 4
+
+/*
+ * With CONFIG_GNTTAB_V2 we ask Xen for version 2 of the table, which
+ * adds sub-page and transitive grants and keeps the reading/writing
+ * bits in separate status frames. Version 1 is used if Xen refuses.
+ */
+#if defined(CONFIG_GNTTAB_V2) && __XEN_INTERFACE_VERSION__ >= 0x0003020a
+#define GNTTAB_V2
+#endif
+
+static unsigned int gnttab_version = 1;
+#ifdef GNTTAB_V2
+static grant_entry_v2_t *gnttab_table_v2;
+static grant_status_t *gnttab_status;
+#define ENTRY_SIZE (gnttab_version == 2 ? sizeof(grant_entry_v2_t) : \
+                                          sizeof(grant_entry_v1_t))
+#define STATUS_FRAMES(f) \
+    (((f) * ENTRIES_PER_FRAME * sizeof(grant_status_t) + PAGE_SIZE - 1) / \
+     PAGE_SIZE)
+#else
+#define ENTRY_SIZE sizeof(grant_entry_v1_t)
+#endif
+
+#define ENTRIES_PER_FRAME (PAGE_SIZE / ENTRY_SIZE)
+#define NR_GRANT_ENTRIES (nr_grant_frames * ENTRIES_PER_FRAME)
+#define MAX_GRANT_ENTRIES (max_grant_frames * ENTRIES_PER_FRAME)
 
 static grant_entry_v1_t *gnttab_table;
-static grant_ref_t gnttab_list[NR_GRANT_ENTRIES];
+static unsigned int nr_grant_frames;
+static unsigned int max_grant_frames;
+static grant_ref_t *gnttab_list;
 #ifdef GNT_DEBUG
-static char inuse[NR_GRANT_ENTRIES];
+static char *inuse;
 #endif
 static __DECLARE_SEMAPHORE_GENERIC(gnttab_sem, 0);
 
+/* Both entry versions start with the flags and domid of the header. */
+static inline uint16_t *
+entry_flags(grant_ref_t ref)
+{
+#ifdef GNTTAB_V2
+    if (gnttab_version == 2)
+        return &gnttab_table_v2[ref].hdr.flags;
+#endif
+    return &gnttab_table[ref].flags;
+}
+
+static inline void
+set_entry(grant_ref_t ref, domid_t domid, unsigned long frame)
+{
+#ifdef GNTTAB_V2
+    if (gnttab_version == 2) {
+        gnttab_table_v2[ref].full_page.frame = frame;
+        gnttab_table_v2[ref].hdr.domid = domid;
+        return;
+    }
+#endif
+    gnttab_table[ref].frame = frame;
+    gnttab_table[ref].domid = domid;
+}
+
+static inline domid_t
+entry_domid(grant_ref_t ref)
+{
+#ifdef GNTTAB_V2
+    if (gnttab_version == 2)
+        return gnttab_table_v2[ref].hdr.domid;
+#endif
+    return gnttab_table[ref].domid;
+}
+
+static inline unsigned long
+entry_frame(grant_ref_t ref)
+{
+#ifdef GNTTAB_V2
+    if (gnttab_version == 2)
+        return gnttab_table_v2[ref].full_page.frame;
+#endif
+    return gnttab_table[ref].frame;
+}
+
+/*
+ * Revoke access through ref. Returns 0, leaving the entry allocated,
+ * if the peer still has it mapped.
+ */
+static int
+revoke_entry(grant_ref_t ref)
+{
+    uint16_t flags, nflags;
+
+#ifdef GNTTAB_V2
+    if (gnttab_version == 2) {
+        gnttab_table_v2[ref].hdr.flags = 0;
+        mb();
+        if (gnttab_status[ref] & (GTF_reading|GTF_writing)) {
+            printk("WARNING: g.e. still in use! (%x)\n", gnttab_status[ref]);
+            return 0;
+        }
+        return 1;
+    }
+#endif
+    nflags = gnttab_table[ref].flags;
+    do {
+        if ((flags = nflags) & (GTF_reading|GTF_writing)) {
+            printk("WARNING: g.e. still in use! (%x)\n", flags);
+            return 0;
+        }
+    } while ((nflags = synch_cmpxchg(&gnttab_table[ref].flags, flags, 0)) !=
+            flags);
+    return 1;
+}
+
+/*
+ * Occupancy and contention counters, see gnttab_dump_stats(). Entries
+ * in use are tracked for the first GNTTAB_STATS_DOMS peers seen at a
+ * time; the rest are lumped together.
+ */
+#define GNTTAB_STATS_DOMS 16
+
+static struct {
+    unsigned long grants;
+    unsigned long ends;
+    unsigned long waits;
+    s_time_t wait_time;
+    int low_water;
+    struct {
+        domid_t domid;
+        unsigned int in_use;
+    } dom[GNTTAB_STATS_DOMS];
+    unsigned int other_in_use;
+    /* Counts and time at the last dump, for rates. */
+    unsigned long last_grants;
+    unsigned long last_ends;
+    s_time_t last_dump;
+} gnttab_stats;
+
+static void
+stats_account(domid_t domid, int n)
+{
+    unsigned long flags;
+    int i, slot = -1;
+
+    local_irq_save(flags);
+    if (n > 0)
+        gnttab_stats.grants += n;
+    else
+        gnttab_stats.ends -= n;
+    for (i = 0; i < GNTTAB_STATS_DOMS; i++) {
+        if (gnttab_stats.dom[i].in_use == 0) {
+            if (slot < 0)
+                slot = i;
+        } else if (gnttab_stats.dom[i].domid == domid) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot >= 0 && (n > 0 || gnttab_stats.dom[slot].in_use)) {
+        gnttab_stats.dom[slot].domid = domid;
+        gnttab_stats.dom[slot].in_use += n;
+    } else {
+        gnttab_stats.other_in_use += n;
+    }
+    local_irq_restore(flags);
+}
+
+/* Called with the free count just lowered. */
+static inline void
+stats_note_free(void)
+{
+    if (gnttab_sem.count < gnttab_stats.low_water)
+        gnttab_stats.low_water = gnttab_sem.count;
+}
+
 static void
 put_free_entry(grant_ref_t ref)
 {
     unsigned long flags;
+    stats_account(entry_domid(ref), -1);
     local_irq_save(flags);
 #ifdef GNT_DEBUG
     BUG_ON(!inuse[ref]);
@@ -48,12 +222,114 @@ put_free_entry(grant_ref_t ref)
     up(&gnttab_sem);
 }
 
+/*
+ * Push entries first..last-1 onto the free list in one go, lowest
+ * entry first out. The caller accounts for them in gnttab_sem.
+ */
+static void
+link_free_entries(grant_ref_t *list, unsigned int first, unsigned int last)
+{
+    unsigned int i;
+
+    if (first == last)
+        return;
+    for (i = first; i < last - 1; i++)
+        list[i] = i + 1;
+    list[last - 1] = list[0];
+    list[0] = first;
+}
+
+/*
+ * Map more frames so that at least want entries are free. This allocates
+ * memory and issues hypercalls, so it is only done from thread context;
+ * elsewhere callers simply wait for entries as before. Returns 0 if the
+ * table grew.
+ */
+static int
+gnttab_grow(unsigned int want)
+{
+    unsigned int old_frames = nr_grant_frames, new_frames, i;
+    unsigned int old_entries = NR_GRANT_ENTRIES, new_entries;
+    grant_ref_t *list, *old_list;
+#ifdef GNT_DEBUG
+    char *used, *old_used;
+#endif
+    unsigned long flags;
+    unsigned int tag;
+
+    if (in_callback || irqs_disabled() || old_frames == max_grant_frames)
+        return -ENOSPC;
+
+    i = 0;
+    if ((int)want > gnttab_sem.count)
+        i = (want - gnttab_sem.count + ENTRIES_PER_FRAME - 1) /
+            ENTRIES_PER_FRAME;
+    new_frames = old_frames + (i > NR_GRANT_FRAMES_INIT ?
+                               i : NR_GRANT_FRAMES_INIT);
+    if (new_frames > max_grant_frames)
+        new_frames = max_grant_frames;
+    new_entries = new_frames * ENTRIES_PER_FRAME;
+
+    tag = mem_tag_set(MEM_TAG_GNTTAB);
+    list = xmalloc_array(grant_ref_t, new_entries);
+#ifdef GNT_DEBUG
+    used = xmalloc_array(char, new_entries);
+#endif
+    mem_tag_set(tag);
+#ifdef GNT_DEBUG
+    if (!used) {
+        xfree(list);
+        return -ENOMEM;
+    }
+#endif
+    if (!list)
+        return -ENOMEM;
+
+    if (arch_grow_gnttab(gnttab_table, old_frames, new_frames)
+#ifdef GNTTAB_V2
+        || (gnttab_version == 2 &&
+            arch_grow_gnttab_status(gnttab_status, STATUS_FRAMES(old_frames),
+                                    STATUS_FRAMES(new_frames)))
+#endif
+        ) {
+        printk("Failed to grow grant table to %u frames\n", new_frames);
+        xfree(list);
+#ifdef GNT_DEBUG
+        xfree(used);
+#endif
+        return -ENOMEM;
+    }
+
+    /* Entries may be freed from event context while we switch lists. */
+    local_irq_save(flags);
+    memcpy(list, gnttab_list, old_entries * sizeof(*list));
+    link_free_entries(list, old_entries, new_entries);
+    old_list = gnttab_list;
+    gnttab_list = list;
+#ifdef GNT_DEBUG
+    memcpy(used, inuse, old_entries);
+    memset(used + old_entries, 0, new_entries - old_entries);
+    old_used = inuse;
+    inuse = used;
+#endif
+    nr_grant_frames = new_frames;
+    gnttab_sem.count += new_entries - old_entries;
+    wake_up(&gnttab_sem.wait);
+    local_irq_restore(flags);
+
+    xfree(old_list);
+#ifdef GNT_DEBUG
+    xfree(old_used);
+#endif
+    return 0;
+}
+
+/* Pop an entry whose semaphore count the caller already holds. */
 static grant_ref_t
-get_free_entry(void)
+__get_free_entry(void)
 {
     unsigned int ref;
     unsigned long flags;
-    down(&gnttab_sem);
     local_irq_save(flags);
     ref = gnttab_list[0];
     BUG_ON(ref < NR_RESERVED_ENTRIES || ref >= NR_GRANT_ENTRIES);
@@ -66,55 +342,375 @@ get_free_entry(void)
     return ref;
 }
 
+static grant_ref_t
+get_free_entry(void)
+{
+    s_time_t start;
+
+    if (gnttab_sem.count <= 0)
+        gnttab_grow(1);
+    if (gnttab_sem.count <= 0) {
+        start = NOW();
+        down(&gnttab_sem);
+        gnttab_stats.waits++;
+        gnttab_stats.wait_time += NOW() - start;
+    } else {
+        down(&gnttab_sem);
+    }
+    stats_note_free();
+    return __get_free_entry();
+}
+
+/* Pop n entries at once; the caller already holds their semaphore count. */
+static void
+__get_free_entries(grant_ref_t *refs, int n)
+{
+    unsigned int ref;
+    unsigned long flags;
+    int i;
+
+    local_irq_save(flags);
+    for (i = 0; i < n; i++) {
+        ref = gnttab_list[0];
+        BUG_ON(ref < NR_RESERVED_ENTRIES || ref >= NR_GRANT_ENTRIES);
+        gnttab_list[0] = gnttab_list[ref];
+#ifdef GNT_DEBUG
+        BUG_ON(inuse[ref]);
+        inuse[ref] = 1;
+#endif
+        refs[i] = ref;
+    }
+    local_irq_restore(flags);
+}
+
+/* Wait until n entries are free and take them in one step. */
+static void
+down_entries(int n)
+{
+    unsigned long flags;
+    s_time_t start = 0;
+
+    if (gnttab_sem.count < n)
+        gnttab_grow(n);
+    if (gnttab_sem.count < n)
+        start = NOW();
+    while (1) {
+        wait_event(gnttab_sem.wait, gnttab_sem.count >= n);
+        local_irq_save(flags);
+        if (gnttab_sem.count >= n)
+            break;
+        local_irq_restore(flags);
+    }
+    gnttab_sem.count -= n;
+    stats_note_free();
+    local_irq_restore(flags);
+    if (start) {
+        gnttab_stats.waits++;
+        gnttab_stats.wait_time += NOW() - start;
+    }
+}
+
+/*
+ * Take count entries out of the free pool without blocking. They are
+ * consumed by gnttab_grant_access_reserved() and any left over must be
+ * returned with gnttab_unreserve(). Returns -ENOSPC if fewer than count
+ * entries are free, in which case nothing is reserved.
+ */
+int
+gnttab_reserve(unsigned int count)
+{
+    unsigned long flags;
+    int rc = -ENOSPC;
+
+    if (gnttab_sem.count < (int)count)
+        gnttab_grow(count);
+    local_irq_save(flags);
+    if (gnttab_sem.count >= (int)count) {
+        gnttab_sem.count -= count;
+        stats_note_free();
+        rc = 0;
+    }
+    local_irq_restore(flags);
+    return rc;
+}
+
+void
+gnttab_unreserve(unsigned int count)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    gnttab_sem.count += count;
+    wake_up(&gnttab_sem.wait);
+    local_irq_restore(flags);
+}
+
+/*
+ * Sleep until at least count entries are free, growing the table first
+ * if it can. Nothing is taken: the caller still has to get them with
+ * gnttab_reserve(), and may find them gone by then.
+ */
+void
+gnttab_wait_free(unsigned int count)
+{
+    if (gnttab_sem.count < (int)count)
+        gnttab_grow(count);
+    wait_event(gnttab_sem.wait, gnttab_sem.count >= (int)count);
+}
+
+static void
+gnttab_fill_entry(grant_ref_t ref, domid_t domid, unsigned long frame,
+                  int readonly)
+{
+    stats_account(domid, 1);
+    set_entry(ref, domid, frame);
+    wmb();
+    readonly *= GTF_readonly;
+    *entry_flags(ref) = GTF_permit_access | readonly;
+}
+
 grant_ref_t
 gnttab_grant_access(domid_t domid, unsigned long frame, int readonly)
 {
     grant_ref_t ref;
 
     ref = get_free_entry();
-    gnttab_table[ref].frame = frame;
-    gnttab_table[ref].domid = domid;
-    wmb();
-    readonly *= GTF_readonly;
-    gnttab_table[ref].flags = GTF_permit_access | readonly;
+    gnttab_fill_entry(ref, domid, frame, readonly);
 
     return ref;
 }
 
+/* Like gnttab_grant_access(), but consumes a gnttab_reserve()d entry. */
+grant_ref_t
+gnttab_grant_access_reserved(domid_t domid, unsigned long frame, int readonly)
+{
+    grant_ref_t ref;
+
+    ref = __get_free_entry();
+    gnttab_fill_entry(ref, domid, frame, readonly);
+
+    return ref;
+}
+
+static void
+gnttab_fill_entries(const grant_ref_t *refs, domid_t domid,
+                    const unsigned long *frames, int n, int readonly)
+{
+    uint16_t flags = GTF_permit_access | (readonly ? GTF_readonly : 0);
+    int i;
+
+    stats_account(domid, n);
+    for (i = 0; i < n; i++)
+        set_entry(refs[i], domid, frames[i]);
+    wmb();
+    for (i = 0; i < n; i++)
+        *entry_flags(refs[i]) = flags;
+}
+
+/*
+ * Grant domid access to frames[0..n-1], storing the references in refs.
+ * Waits until n entries are free, then takes them all at once and
+ * publishes them behind a single write barrier.
+ */
+int
+gnttab_grant_access_batch(domid_t domid, const unsigned long *frames, int n,
+                          int readonly, grant_ref_t *refs)
+{
+    if (n <= 0 || n > MAX_GRANT_ENTRIES - NR_RESERVED_ENTRIES)
+        return -EINVAL;
+
+    down_entries(n);
+    __get_free_entries(refs, n);
+    gnttab_fill_entries(refs, domid, frames, n, readonly);
+
+    return 0;
+}
+
+/* Like gnttab_grant_access_batch(), but consumes gnttab_reserve()d entries. */
+void
+gnttab_grant_access_batch_reserved(domid_t domid, const unsigned long *frames,
+                                   int n, int readonly, grant_ref_t *refs)
+{
+    __get_free_entries(refs, n);
+    gnttab_fill_entries(refs, domid, frames, n, readonly);
+}
+
 grant_ref_t
 gnttab_grant_transfer(domid_t domid, unsigned long pfn)
 {
     grant_ref_t ref;
 
     ref = get_free_entry();
-    gnttab_table[ref].frame = pfn;
-    gnttab_table[ref].domid = domid;
+    stats_account(domid, 1);
+    set_entry(ref, domid, pfn);
     wmb();
-    gnttab_table[ref].flags = GTF_accept_transfer;
+    *entry_flags(ref) = GTF_accept_transfer;
 
     return ref;
 }
 
+/*
+ * Grant domid copy access to length bytes at offset in frame. Such
+ * grants cannot be mapped, only used with GNTTABOP_copy. Needs a
+ * version 2 table, -ENOSYS otherwise.
+ */
 int
-gnttab_end_access(grant_ref_t ref)
+gnttab_grant_access_subpage(domid_t domid, unsigned long frame, int readonly,
+                            unsigned int offset, unsigned int length,
+                            grant_ref_t *ref)
 {
-    uint16_t flags, nflags;
+#ifdef GNTTAB_V2
+    grant_ref_t r;
+
+    if (gnttab_version != 2)
+        return -ENOSYS;
+    if (offset >= PAGE_SIZE || length == 0 || length > PAGE_SIZE - offset)
+        return -EINVAL;
+
+    r = get_free_entry();
+    stats_account(domid, 1);
+    gnttab_table_v2[r].sub_page.frame = frame;
+    gnttab_table_v2[r].sub_page.page_off = offset;
+    gnttab_table_v2[r].sub_page.length = length;
+    gnttab_table_v2[r].hdr.domid = domid;
+    wmb();
+    gnttab_table_v2[r].hdr.flags = GTF_permit_access | GTF_sub_page |
+                                   (readonly ? GTF_readonly : 0);
+    *ref = r;
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+/*
+ * Let domid use trans_gref of trans_domid as if it were ours, so that a
+ * page granted to us can be passed on without copying. Like sub-page
+ * grants these can only be copied from, and need a version 2 table.
+ */
+int
+gnttab_grant_access_transitive(domid_t domid, domid_t trans_domid,
+                               grant_ref_t trans_gref, grant_ref_t *ref)
+{
+#ifdef GNTTAB_V2
+    grant_ref_t r;
 
+    if (gnttab_version != 2)
+        return -ENOSYS;
+
+    r = get_free_entry();
+    stats_account(domid, 1);
+    gnttab_table_v2[r].transitive.trans_domid = trans_domid;
+    gnttab_table_v2[r].transitive.gref = trans_gref;
+    gnttab_table_v2[r].hdr.domid = domid;
+    wmb();
+    gnttab_table_v2[r].hdr.flags = GTF_transitive;
+    *ref = r;
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+int
+gnttab_get_version(void)
+{
+    return gnttab_version;
+}
+
+/*
+ * Take access through ref away from its peer but keep the entry, so it
+ * can be re-armed later with gnttab_regrant_access(). Returns 0 if the
+ * peer still has it mapped.
+ */
+int
+gnttab_revoke_access(grant_ref_t ref)
+{
     BUG_ON(ref >= NR_GRANT_ENTRIES || ref < NR_RESERVED_ENTRIES);
 
-    nflags = gnttab_table[ref].flags;
-    do {
-        if ((flags = nflags) & (GTF_reading|GTF_writing)) {
-            printk("WARNING: g.e. still in use! (%x)\n", flags);
-            return 0;
-        }
-    } while ((nflags = synch_cmpxchg(&gnttab_table[ref].flags, flags, 0)) !=
-            flags);
+    return revoke_entry(ref);
+}
+
+/*
+ * Point ref, which we still hold, at frame for domid again without a
+ * trip through the free list. Meant for ring buffers that go back to
+ * the same peer over and over. Returns 0, leaving ref as it was, if the
+ * peer still has it mapped.
+ */
+int
+gnttab_regrant_access(grant_ref_t ref, domid_t domid, unsigned long frame,
+                      int readonly)
+{
+    domid_t old;
+
+    BUG_ON(ref >= NR_GRANT_ENTRIES || ref < NR_RESERVED_ENTRIES);
+
+    old = entry_domid(ref);
+    if (!revoke_entry(ref))
+        return 0;
+
+    if (old != domid) {
+        stats_account(old, -1);
+        stats_account(domid, 1);
+    } else {
+        gnttab_stats.ends++;
+        gnttab_stats.grants++;
+    }
+    set_entry(ref, domid, frame);
+    wmb();
+    *entry_flags(ref) = GTF_permit_access | (readonly ? GTF_readonly : 0);
+
+    return 1;
+}
+
+int
+gnttab_end_access(grant_ref_t ref)
+{
+    BUG_ON(ref >= NR_GRANT_ENTRIES || ref < NR_RESERVED_ENTRIES);
+
+    if (!revoke_entry(ref))
+        return 0;
 
     put_free_entry(ref);
     return 1;
 }
 
+/*
+ * End access for refs[0..n-1] and return them to the free list under a
+ * single lock. Entries the peer still has mapped are left alone, as in
+ * gnttab_end_access(). Returns the number of entries ended.
+ */
+int
+gnttab_end_access_batch(const grant_ref_t *refs, int n)
+{
+    unsigned long irqflags;
+    grant_ref_t ref;
+    int i, freed = 0;
+
+    local_irq_save(irqflags);
+    for (i = 0; i < n; i++) {
+        ref = refs[i];
+        BUG_ON(ref >= NR_GRANT_ENTRIES || ref < NR_RESERVED_ENTRIES);
+
+        if (!revoke_entry(ref))
+            continue;
+
+        stats_account(entry_domid(ref), -1);
+#ifdef GNT_DEBUG
+        BUG_ON(!inuse[ref]);
+        inuse[ref] = 0;
+#endif
+        gnttab_list[ref] = gnttab_list[0];
+        gnttab_list[0]  = ref;
+        freed++;
+    }
+    gnttab_sem.count += freed;
+    wake_up(&gnttab_sem.wait);
+    local_irq_restore(irqflags);
+
+    return freed;
+}
+
 unsigned long
 gnttab_end_transfer(grant_ref_t ref)
 {
@@ -123,8 +719,8 @@ gnttab_end_transfer(grant_ref_t ref)
 
     BUG_ON(ref >= NR_GRANT_ENTRIES || ref < NR_RESERVED_ENTRIES);
 
-    while (!((flags = gnttab_table[ref].flags) & GTF_transfer_committed)) {
-        if (synch_cmpxchg(&gnttab_table[ref].flags, flags, 0) == flags) {
+    while (!((flags = *entry_flags(ref)) & GTF_transfer_committed)) {
+        if (synch_cmpxchg(entry_flags(ref), flags, 0) == flags) {
             printk("Release unused transfer grant.\n");
             put_free_entry(ref);
             return 0;
@@ -133,12 +729,12 @@ gnttab_end_transfer(grant_ref_t ref)
 
     /* If a transfer is in progress then wait until it is completed. */
     while (!(flags & GTF_transfer_completed)) {
-        flags = gnttab_table[ref].flags;
+        flags = *entry_flags(ref);
     }
 
     /* Read the frame number /after/ reading completion status. */
     rmb();
-    frame = gnttab_table[ref].frame;
+    frame = entry_frame(ref);
 
     put_free_entry(ref);
 
@@ -177,19 +773,193 @@ gnttab_reset_model(void)
     return rc;
 }
 
+/* Per second rate of count events over ns nanoseconds. */
+static unsigned long
+stats_rate(unsigned long count, s_time_t ns)
+{
+    return ns > 0 ? (unsigned long)((uint64_t)count * SECONDS(1) / ns) : 0;
+}
+
+/*
+ * Print occupancy and contention counters. Rates are over the time
+ * since the previous dump.
+ */
 void
-init_gnttab(void)
+gnttab_dump_stats(void)
 {
+    s_time_t now = NOW(), span = now - gnttab_stats.last_dump;
     int i;
 
-#ifdef GNT_DEBUG
-    memset(inuse, 1, sizeof(inuse));
+    printk("gnttab: %u/%u frames, %lu entries, %d free, low water %d\n",
+           nr_grant_frames, max_grant_frames,
+           (unsigned long)(NR_GRANT_ENTRIES - NR_RESERVED_ENTRIES),
+           gnttab_sem.count, gnttab_stats.low_water);
+    printk("gnttab: %lu grants (%lu/s), %lu ends (%lu/s), "
+           "%lu waits for %lu us\n",
+           gnttab_stats.grants,
+           stats_rate(gnttab_stats.grants - gnttab_stats.last_grants, span),
+           gnttab_stats.ends,
+           stats_rate(gnttab_stats.ends - gnttab_stats.last_ends, span),
+           gnttab_stats.waits,
+           (unsigned long)(gnttab_stats.wait_time / 1000));
+    for (i = 0; i < GNTTAB_STATS_DOMS; i++)
+        if (gnttab_stats.dom[i].in_use)
+            printk("gnttab:   dom%u: %u in use\n",
+                   gnttab_stats.dom[i].domid, gnttab_stats.dom[i].in_use);
+    if (gnttab_stats.other_in_use)
+        printk("gnttab:   others: %u in use\n", gnttab_stats.other_in_use);
+
+    gnttab_stats.last_grants = gnttab_stats.grants;
+    gnttab_stats.last_ends = gnttab_stats.ends;
+    gnttab_stats.last_dump = now;
+}
+
+#ifdef CONFIG_XENBUS
+/* Peers with an in-use/<domid> node from the last gnttab_write_stats(). */
+static domid_t stats_written[GNTTAB_STATS_DOMS];
+static int nr_stats_written;
+
+/*
+ * Publish the counters under path: free, low-water, waits, wait-us,
+ * grants, ends and in-use/<domid> for each tracked peer. Nodes of peers
+ * no longer tracked are removed, so callers should stick to one path.
+ */
+int
+gnttab_write_stats(const char *path)
+{
+    char *err, key[32], node[128];
+    domid_t doms[GNTTAB_STATS_DOMS];
+    unsigned int in_use[GNTTAB_STATS_DOMS];
+    int i, j, nr = 0;
+
+#define WRITE_STAT(node, fmt, ...) do {                             \
+        err = xenbus_printf(XBT_NIL, path, node, fmt, __VA_ARGS__); \
+        if (err) {                                                  \
+            printk("gnttab: cannot write stats to %s: %s\n", path, err); \
+            free(err);                                              \
+            return -EIO;                                            \
+        }                                                           \
+    } while (0)
+
+    WRITE_STAT("free", "%d", gnttab_sem.count);
+    WRITE_STAT("low-water", "%d", gnttab_stats.low_water);
+    WRITE_STAT("waits", "%lu", gnttab_stats.waits);
+    WRITE_STAT("wait-us", "%lu",
+               (unsigned long)(gnttab_stats.wait_time / 1000));
+    WRITE_STAT("grants", "%lu", gnttab_stats.grants);
+    WRITE_STAT("ends", "%lu", gnttab_stats.ends);
+
+    for (i = 0; i < GNTTAB_STATS_DOMS; i++) {
+        if (!gnttab_stats.dom[i].in_use)
+            continue;
+        doms[nr] = gnttab_stats.dom[i].domid;
+        in_use[nr++] = gnttab_stats.dom[i].in_use;
+    }
+
+    /* Drop the nodes of peers whose slot was freed or reassigned. */
+    for (i = 0; i < nr_stats_written; i++) {
+        for (j = 0; j < nr; j++)
+            if (doms[j] == stats_written[i])
+                break;
+        if (j < nr)
+            continue;
+        snprintf(node, sizeof(node), "%s/in-use/%u", path, stats_written[i]);
+        free(xenbus_rm(XBT_NIL, node));
+    }
+    memcpy(stats_written, doms, nr * sizeof(*doms));
+    nr_stats_written = nr;
+
+    for (i = 0; i < nr; i++) {
+        snprintf(key, sizeof(key), "in-use/%u", doms[i]);
+        WRITE_STAT(key, "%u", in_use[i]);
+    }
+#undef WRITE_STAT
+
+    return 0;
+}
+#else
+int
+gnttab_write_stats(const char *path)
+{
+    return -ENOSYS;
+}
 #endif
-    for (i = NR_RESERVED_ENTRIES; i < NR_GRANT_ENTRIES; i++)
-        put_free_entry(i);
 
-    gnttab_table = arch_init_gnttab(NR_GRANT_FRAMES);
-    printk("gnttab_table mapped at %p.\n", gnttab_table);
+#ifdef GNTTAB_V2
+static int
+set_version(uint32_t version)
+{
+    struct gnttab_set_version sv = { .version = version };
+    int rc;
+
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_set_version, &sv, 1);
+    if (rc == 0 && sv.version != version)
+        rc = -ENOSYS;
+    return rc;
+}
+#endif
+
+void
+init_gnttab(void)
+{
+    struct gnttab_query_size query;
+    s_time_t start = NOW();
+    unsigned int tag = mem_tag_set(MEM_TAG_GNTTAB);
+
+    query.dom = DOMID_SELF;
+    if (HYPERVISOR_grant_table_op(GNTTABOP_query_size, &query, 1) ||
+        query.status != GNTST_okay) {
+        printk("GNTTABOP_query_size failed, using %d grant frames\n",
+               NR_GRANT_FRAMES_INIT);
+        query.nr_frames = 0;
+        query.max_nr_frames = NR_GRANT_FRAMES_INIT;
+    }
+    max_grant_frames = query.max_nr_frames;
+    nr_grant_frames = query.nr_frames > NR_GRANT_FRAMES_INIT ?
+                      query.nr_frames : NR_GRANT_FRAMES_INIT;
+    if (nr_grant_frames > max_grant_frames)
+        nr_grant_frames = max_grant_frames;
+
+#ifdef GNTTAB_V2
+    if (set_version(2) == 0)
+        gnttab_version = 2;
+#endif
+    gnttab_table = arch_init_gnttab(nr_grant_frames, max_grant_frames);
+#ifdef GNTTAB_V2
+    if (gnttab_version == 2) {
+        gnttab_table_v2 = (grant_entry_v2_t *)gnttab_table;
+        gnttab_status = arch_init_gnttab_status(STATUS_FRAMES(nr_grant_frames),
+                                                STATUS_FRAMES(max_grant_frames));
+        if (!gnttab_status) {
+            printk("Cannot map grant status frames, using version 1\n");
+            BUG_ON(set_version(1));
+            gnttab_version = 1;
+        }
+    }
+#endif
+    printk("gnttab_table v%u mapped at %p, %u of %u frames.\n",
+           gnttab_version, gnttab_table, nr_grant_frames, max_grant_frames);
+
+    gnttab_list = xmalloc_array(grant_ref_t, NR_GRANT_ENTRIES);
+    BUG_ON(!gnttab_list);
+#ifdef GNT_DEBUG
+    inuse = xmalloc_array(char, NR_GRANT_ENTRIES);
+    BUG_ON(!inuse);
+    memset(inuse, 1, NR_RESERVED_ENTRIES);
+    memset(inuse + NR_RESERVED_ENTRIES, 0,
+           NR_GRANT_ENTRIES - NR_RESERVED_ENTRIES);
+#endif
+    /* Nothing can allocate yet, so build the list without locking. */
+    gnttab_list[0] = 0;
+    link_free_entries(gnttab_list, NR_RESERVED_ENTRIES, NR_GRANT_ENTRIES);
+    gnttab_sem.count = NR_GRANT_ENTRIES - NR_RESERVED_ENTRIES;
+    gnttab_stats.low_water = gnttab_sem.count;
+    gnttab_stats.last_dump = NOW();
+
+    printk("gnttab: %u free entries, init took %lu us\n",
+           (unsigned int)(NR_GRANT_ENTRIES - NR_RESERVED_ENTRIES),
+           (unsigned long)((NOW() - start) / 1000));
+    mem_tag_set(tag);
 }
 
 void
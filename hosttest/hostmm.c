@@ -0,0 +1,57 @@
+/*
+ * Fake machine for running mm.c as a Linux program: a single RAM region
+ * of HOST_MEM_SIZE bytes, aligned to its size in the process so buddy
+ * addresses are computed exactly as in a domain. "Physical" addresses
+ * are offsets into it, and the first HOST_IMAGE_PAGES pages stand in
+ * for the kernel image below start_pfn.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <mini-os/os.h>
+#include <mini-os/types.h>
+#include <mini-os/mm.h>
+#include <mini-os/e820.h>
+
+#define HOST_MEM_SIZE       (64UL << 20)
+#define HOST_IMAGE_PAGES    16
+
+unsigned long host_virt_base;
+struct e820entry e820_map[1];
+unsigned e820_entries;
+
+void arch_init_mm(unsigned long *start_pfn_p, unsigned long *max_pfn_p)
+{
+    void *mem;
+
+    if ( posix_memalign(&mem, HOST_MEM_SIZE, HOST_MEM_SIZE) )
+    {
+        fprintf(stderr, "cannot allocate %lu bytes of fake memory\n",
+                HOST_MEM_SIZE);
+        exit(1);
+    }
+    host_virt_base = (unsigned long)mem;
+
+    e820_map[0].addr = 0;
+    e820_map[0].size = HOST_MEM_SIZE;
+    e820_map[0].type = E820_RAM;
+    e820_entries = 1;
+
+    *start_pfn_p = HOST_IMAGE_PAGES;
+    *max_pfn_p = HOST_MEM_SIZE >> PAGE_SHIFT;
+}
+
+void arch_init_p2m(unsigned long max_pfn)
+{
+}
+
+void arch_init_demand_mapping_area(void)
+{
+}
+
+int do_map_frames(unsigned long addr,
+        const unsigned long *f, unsigned long n, unsigned long stride,
+        unsigned long increment, domid_t id, int *err, unsigned long prot)
+{
+    return -ENOSYS;
+}
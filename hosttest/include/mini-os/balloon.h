@@ -0,0 +1 @@
+#include "../../../include/balloon.h"
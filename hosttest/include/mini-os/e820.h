@@ -0,0 +1 @@
+#include "../../../include/e820.h"
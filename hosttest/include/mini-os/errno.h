@@ -0,0 +1 @@
+#include <errno.h>
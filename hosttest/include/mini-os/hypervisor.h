@@ -0,0 +1,10 @@
+/* No hypervisor on the host: every hypercall fails. */
+#ifndef _HOSTTEST_HYPERVISOR_H_
+#define _HOSTTEST_HYPERVISOR_H_
+
+static inline int HYPERVISOR_memory_op(unsigned int cmd, void *arg)
+{
+    return -1;
+}
+
+#endif /* _HOSTTEST_HYPERVISOR_H_ */
@@ -0,0 +1,17 @@
+#ifndef _HOSTTEST_LIB_H_
+#define _HOSTTEST_LIB_H_
+
+#include <string.h>
+
+#define ASSERT(x)                                              \
+do {                                                           \
+    if (!(x)) {                                                \
+        printk("ASSERTION FAILED: %s at %s:%d.\n",             \
+               # x, __FILE__, __LINE__);                       \
+        BUG();                                                 \
+    }                                                          \
+} while(0)
+
+#define BUG_ON(x) ASSERT(!(x))
+
+#endif /* _HOSTTEST_LIB_H_ */
@@ -0,0 +1 @@
+#include "../../../include/list.h"
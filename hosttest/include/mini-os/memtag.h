@@ -0,0 +1 @@
+#include "../../../include/memtag.h"
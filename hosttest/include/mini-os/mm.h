@@ -0,0 +1,89 @@
+/*
+ * Page allocator interface as seen by lib/ and mm.c. Programs either
+ * link hosttest/pages.c, which hands out naturally aligned blocks from
+ * the C heap, or mm.c itself on the fake machine of hosttest/hostmm.c.
+ */
+#ifndef _HOSTTEST_MM_H_
+#define _HOSTTEST_MM_H_
+
+#include <xen/memory.h>
+
+#define PAGE_SHIFT      12
+#define PAGE_SIZE       (1UL << PAGE_SHIFT)
+#define PAGE_MASK       (~(PAGE_SIZE-1))
+
+#define round_pgdown(_p)  ((_p) & PAGE_MASK)
+#define round_pgup(_p)    (((_p) + (PAGE_SIZE - 1)) & PAGE_MASK)
+
+/* "Physical" addresses are offsets into the fake machine's memory. */
+extern unsigned long host_virt_base;
+
+#define PFN_UP(x)       (((x) + PAGE_SIZE-1) >> PAGE_SHIFT)
+#define PFN_DOWN(x)     ((x) >> PAGE_SHIFT)
+#define PFN_PHYS(x)     ((uint64_t)(x) << PAGE_SHIFT)
+#define PHYS_PFN(x)     ((x) >> PAGE_SHIFT)
+
+#define to_phys(x)          ((unsigned long)(x) - host_virt_base)
+#define to_virt(x)          ((void *)((unsigned long)(x) + host_virt_base))
+#define virt_to_pfn(_virt)  (PFN_DOWN(to_phys(_virt)))
+#define pfn_to_virt(_pfn)   (to_virt((_pfn) << PAGE_SHIFT))
+
+#define L1_PROT         0
+
+extern unsigned long *mm_alloc_bitmap;
+extern unsigned long mm_alloc_bitmap_size;
+extern unsigned long nr_free_pages;
+
+void init_mm(void);
+unsigned long alloc_pages(int order);
+unsigned long alloc_pages_tag(int order, unsigned int tag);
+unsigned long try_alloc_pages(int order);
+#define alloc_page()    alloc_pages(0)
+void free_pages(void *pointer, int order);
+#define free_page(p)    free_pages(p, 0)
+int largest_free_order(void);
+void dump_page_allocator(void);
+void sanity_check(void);
+
+static __inline__ int get_order(unsigned long size)
+{
+    int order;
+    size = (size-1) >> PAGE_SHIFT;
+    for ( order = 0; size; order++ )
+        size >>= 1;
+    return order;
+}
+
+/* Same layout as in include/mm.h; pages.c never calls them. */
+struct shrinker {
+    const char *name;
+    int priority;
+    unsigned long (*shrink)(struct shrinker *s, unsigned long nr_pages);
+    unsigned long calls, freed;
+    struct shrinker *next;
+};
+
+#define MM_LOW_WATERMARK    128
+#define MM_HIGH_WATERMARK   256
+
+void register_shrinker(struct shrinker *s);
+void unregister_shrinker(struct shrinker *s);
+unsigned long shrink_memory(unsigned long nr_pages);
+void set_mm_watermarks(unsigned long low, unsigned long high);
+unsigned long mm_high_watermark(void);
+
+int map_frame_rw(unsigned long addr, unsigned long mfn);
+int free_physical_pages(xen_pfn_t *mfns, int n);
+
+/* The arch hooks mm.c calls, provided by hostmm.c. */
+void arch_init_mm(unsigned long *start_pfn_p, unsigned long *max_pfn_p);
+void arch_init_p2m(unsigned long max_pfn);
+void arch_init_demand_mapping_area(void);
+int do_map_frames(unsigned long addr,
+        const unsigned long *f, unsigned long n, unsigned long stride,
+        unsigned long increment, domid_t id, int *err, unsigned long prot);
+
+/* Pages currently handed out by the host page allocator. */
+extern unsigned long host_pages_in_use;
+
+#endif /* _HOSTTEST_MM_H_ */
@@ -0,0 +1,28 @@
+/*
+ * Minimal stand-in for <mini-os/os.h> so allocator code can be built
+ * and exercised as a Linux user-space program.
+ */
+#ifndef _HOSTTEST_OS_H_
+#define _HOSTTEST_OS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define printk(_f, _a...) printf(_f, ## _a)
+#define BUG() abort()
+
+#define __cacheline_aligned __attribute__((__aligned__(64)))
+#define __packed __attribute__((__packed__))
+
+/* One thread and no interrupts. */
+#define irqs_disabled() 0
+
+static inline unsigned long __ffs(unsigned long word)
+{
+    return __builtin_ctzl(word);
+}
+
+#endif /* _HOSTTEST_OS_H_ */
@@ -0,0 +1 @@
+/* Nothing in the allocators depends on the paravirt interfaces. */
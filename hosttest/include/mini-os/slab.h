@@ -0,0 +1 @@
+#include "../../../include/slab.h"
@@ -0,0 +1,7 @@
+#ifndef _HOSTTEST_TYPES_H_
+#define _HOSTTEST_TYPES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#endif /* _HOSTTEST_TYPES_H_ */
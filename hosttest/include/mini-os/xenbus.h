@@ -0,0 +1 @@
+/* Only lib/memtag.c includes this, and uses it with CONFIG_XENBUS only. */
@@ -0,0 +1 @@
+#include "../../../include/xmalloc.h"
@@ -0,0 +1,23 @@
+/* The parts of the Xen memory interface mm.c refers to. */
+#ifndef _HOSTTEST_XEN_MEMORY_H_
+#define _HOSTTEST_XEN_MEMORY_H_
+
+#include <stdint.h>
+
+typedef unsigned long xen_pfn_t;
+typedef uint16_t domid_t;
+
+#define DOMID_SELF                  0x7FF0U
+#define XENMEM_decrease_reservation 1
+
+struct xen_memory_reservation {
+    xen_pfn_t *extent_start;
+    unsigned long nr_extents;
+    unsigned int extent_order;
+    unsigned int mem_flags;
+    domid_t domid;
+};
+
+#define set_xen_guest_handle(hnd, val) do { (hnd) = (val); } while (0)
+
+#endif /* _HOSTTEST_XEN_MEMORY_H_ */
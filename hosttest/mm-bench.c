@@ -0,0 +1,417 @@
+/*
+ * Randomised stress tests and benchmarks for the buddy allocator in
+ * mm.c, and for xmalloc() running on top of it, on the fake machine of
+ * hostmm.c:
+ *
+ *   make hosttest && hosttest/mm-bench [seed]
+ *
+ * Every workload keeps a pool of live allocations and replaces a random
+ * one per operation. A checked pass stamps each allocation and verifies
+ * the stamp on free, and walks the buddy lists with sanity_check() as it
+ * goes; a timed pass then runs the same workload without the checks.
+ * Afterwards everything is freed, and the free memory and the per-tag
+ * counters must be back where they started.
+ *
+ * "frag" is the share of free memory outside the largest free run of
+ * pages, read from the allocation bitmap at the end of the timed pass,
+ * and "largest" the largest free order at that point.
+ * For xmalloc, "overhead" is the memory taken from the page allocator
+ * per byte of live objects. Like xmalloc.c, this file is built with
+ * malloc() and friends renamed, so they are the Mini-OS ones here.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <mini-os/os.h>
+#include <mini-os/mm.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/memtag.h>
+
+#define CHECK_OPS   (1 << 18)
+#define BENCH_OPS   (1 << 20)
+#define MAX_LIVE    8192
+
+struct page_workload {
+    const char *name;
+    int max_order;          /* Orders are geometric, 0 the most common. */
+    unsigned int live;
+};
+
+struct heap_workload {
+    const char *name;
+    size_t min, max;        /* Most objects are in [min, max]... */
+    unsigned int large_pct; /* ...this many percent up to large_max. */
+    size_t large_max;
+    unsigned int realloc_pct;
+    unsigned int live;
+};
+
+static const struct page_workload page_workloads[] = {
+    { "single", 0, 4096 },
+    { "mixed",  4, 1024 },
+    { "large",  6,  128 },
+};
+
+static const struct heap_workload heap_workloads[] = {
+    { "small",   8,  256, 0,     0,  0, 8192 },
+    { "mixed",   8,  512, 5, 16384, 10, 4096 },
+    { "buffers", 512, 2048, 10, 65536, 0, 1024 },
+};
+
+struct live {
+    void *p;
+    size_t size;            /* Bytes for xmalloc, order for pages. */
+    unsigned int stamp;
+};
+
+static struct live live[MAX_LIVE];
+static unsigned long failures;
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, const char *name, void *p)
+{
+    if ( failures++ < 10 )
+        printf("FAIL %s: %s at %p\n", name, what, p);
+}
+
+/* Share of free pages outside the largest run of free pages. */
+static double fragmentation(void)
+{
+    unsigned long pfn, nr = mm_alloc_bitmap_size * 8;
+    unsigned long free = 0, run = 0, best = 0;
+
+    for ( pfn = 0; pfn < nr; pfn++ )
+    {
+        if ( mm_alloc_bitmap[pfn / (sizeof(long) * 8)] &
+             (1UL << (pfn % (sizeof(long) * 8))) )
+        {
+            run = 0;
+            continue;
+        }
+        free++;
+        if ( ++run > best )
+            best = run;
+    }
+    return free ? 1.0 - (double)best / free : 0.0;
+}
+
+struct snapshot {
+    unsigned long free_pages;
+    int largest;
+    unsigned long tag_bytes[NR_MEM_TAGS];
+};
+
+static void snapshot(struct snapshot *s)
+{
+    int t;
+
+    s->free_pages = nr_free_pages;
+    s->largest = largest_free_order();
+    for ( t = 0; t < NR_MEM_TAGS; t++ )
+        s->tag_bytes[t] = mem_tag_stats[t].cur;
+}
+
+/* Everything freed must merge back and be credited to its tag. */
+static void check_released(const char *name, struct snapshot *before)
+{
+    struct snapshot after;
+    int t;
+
+    snapshot(&after);
+    if ( after.free_pages != before->free_pages )
+    {
+        printf("FAIL %s: %lu pages free after, %lu before\n", name,
+               after.free_pages, before->free_pages);
+        failures++;
+    }
+    if ( after.largest != before->largest )
+    {
+        printf("FAIL %s: largest free order %d after, %d before\n", name,
+               after.largest, before->largest);
+        failures++;
+    }
+    for ( t = 0; t < NR_MEM_TAGS; t++ )
+    {
+        if ( after.tag_bytes[t] == before->tag_bytes[t] )
+            continue;
+        printf("FAIL %s: tag %s holds %lu bytes after, %lu before\n", name,
+               mem_tag_name(t), after.tag_bytes[t], before->tag_bytes[t]);
+        failures++;
+    }
+    sanity_check();
+}
+
+/* Buddy allocator. */
+
+static int random_order(int max_order)
+{
+    int order = 0;
+
+    while ( order < max_order && (rnd() & 1) )
+        order++;
+    return order;
+}
+
+/* Stamp the first word of every page, so any overlap is caught. */
+static void page_stamp(struct live *l)
+{
+    unsigned long i;
+
+    for ( i = 0; i < (1UL << l->size); i++ )
+        *(unsigned int *)((char *)l->p + i * PAGE_SIZE) = l->stamp + i;
+}
+
+static void page_check(const char *name, struct live *l)
+{
+    unsigned long i;
+
+    if ( (unsigned long)l->p & ((PAGE_SIZE << l->size) - 1) )
+        fail("misaligned block", name, l->p);
+    for ( i = 0; i < (1UL << l->size); i++ )
+        if ( *(unsigned int *)((char *)l->p + i * PAGE_SIZE) != l->stamp + i )
+            fail("block overwritten", name, l->p);
+}
+
+static unsigned long page_run(const struct page_workload *w, unsigned long ops,
+                              int check)
+{
+    struct live *l;
+    unsigned long op, nomem = 0;
+
+    for ( op = 0; op < ops; op++ )
+    {
+        l = &live[rnd() % w->live];
+        if ( l->p )
+        {
+            if ( check )
+                page_check(w->name, l);
+            free_pages(l->p, l->size);
+        }
+        l->size = random_order(w->max_order);
+        l->p = (void *)alloc_pages(l->size);
+        if ( l->p == NULL )
+        {
+            nomem++;
+            continue;
+        }
+        if ( check )
+        {
+            l->stamp = rnd();
+            page_stamp(l);
+            if ( !(op & 4095) )
+                sanity_check();
+        }
+    }
+    return nomem;
+}
+
+static void page_release(const struct page_workload *w)
+{
+    unsigned int i;
+
+    for ( i = 0; i < w->live; i++ )
+        if ( live[i].p )
+        {
+            free_pages(live[i].p, live[i].size);
+            live[i].p = NULL;
+        }
+}
+
+static void page_bench(const struct page_workload *w)
+{
+    struct snapshot before;
+    unsigned long nomem, held;
+    double t, frag;
+    int largest;
+
+    snapshot(&before);
+    page_run(w, CHECK_OPS, 1);
+    page_release(w);
+    check_released(w->name, &before);
+
+    t = now();
+    nomem = page_run(w, BENCH_OPS, 0);
+    t = now() - t;
+    held = before.free_pages - nr_free_pages;
+    frag = fragmentation();
+    largest = largest_free_order();
+    page_release(w);
+    check_released(w->name, &before);
+
+    printf("pages   %-8s %7.2f %8.1f %6u %8lu %7.1f%% %7d %7lu\n",
+           w->name, BENCH_OPS / t / 1e6, t / BENCH_OPS * 1e9, w->live,
+           held, frag * 100, largest, nomem);
+}
+
+/* xmalloc() on top of the buddy allocator. */
+
+static size_t random_size(const struct heap_workload *w)
+{
+    if ( w->large_pct && rnd() % 100 < w->large_pct )
+        return w->max + rnd() % (w->large_max - w->max) + 1;
+    return w->min + rnd() % (w->max - w->min + 1);
+}
+
+static void heap_check(const char *name, struct live *l, size_t size)
+{
+    unsigned char *p = l->p;
+    size_t i;
+
+    if ( (unsigned long)p & (DEFAULT_ALIGN - 1) )
+        fail("misaligned object", name, p);
+    for ( i = 0; i < size; i++ )
+        if ( p[i] != (unsigned char)(l->stamp + i) )
+        {
+            fail("object overwritten", name, p);
+            break;
+        }
+}
+
+static void heap_stamp(struct live *l)
+{
+    unsigned char *p = l->p;
+    size_t i;
+
+    for ( i = 0; i < l->size; i++ )
+        p[i] = l->stamp + i;
+}
+
+static unsigned long heap_run(const struct heap_workload *w,
+                              unsigned long ops, int check,
+                              unsigned long *live_bytes)
+{
+    struct live *l;
+    unsigned long op, nomem = 0;
+    size_t size;
+    void *p;
+
+    for ( op = 0; op < ops; op++ )
+    {
+        l = &live[rnd() % w->live];
+        size = random_size(w);
+
+        if ( l->p && w->realloc_pct && rnd() % 100 < w->realloc_pct )
+        {
+            p = realloc(l->p, size);
+            if ( p == NULL )
+            {
+                nomem++;
+                continue;
+            }
+            l->p = p;
+            if ( check )
+                heap_check(w->name, l, size < l->size ? size : l->size);
+            *live_bytes += size - l->size;
+            l->size = size;
+            if ( check )
+                heap_stamp(l);
+            continue;
+        }
+
+        if ( l->p )
+        {
+            if ( check )
+                heap_check(w->name, l, l->size);
+            xfree(l->p);
+            *live_bytes -= l->size;
+        }
+        l->p = malloc(size);
+        if ( l->p == NULL )
+        {
+            nomem++;
+            continue;
+        }
+        l->size = size;
+        *live_bytes += size;
+        if ( check )
+        {
+            l->stamp = rnd();
+            heap_stamp(l);
+        }
+    }
+    return nomem;
+}
+
+static void heap_release(const struct heap_workload *w)
+{
+    unsigned int i;
+
+    for ( i = 0; i < w->live; i++ )
+        if ( live[i].p )
+        {
+            xfree(live[i].p);
+            live[i].p = NULL;
+        }
+}
+
+static void heap_bench(const struct heap_workload *w)
+{
+    struct snapshot before;
+    unsigned long nomem, held, live_bytes = 0;
+    double t, frag;
+    int largest;
+
+    snapshot(&before);
+    heap_run(w, CHECK_OPS, 1, &live_bytes);
+    heap_release(w);
+    check_released(w->name, &before);
+
+    live_bytes = 0;
+    t = now();
+    nomem = heap_run(w, BENCH_OPS, 0, &live_bytes);
+    t = now() - t;
+    held = before.free_pages - nr_free_pages;
+    frag = fragmentation();
+    largest = largest_free_order();
+    heap_release(w);
+    check_released(w->name, &before);
+
+    printf("xmalloc %-8s %7.2f %8.1f %6u %8lu %7.1f%% %7d %7lu  %.2f\n",
+           w->name, BENCH_OPS / t / 1e6, t / BENCH_OPS * 1e9, w->live,
+           held, frag * 100, largest, nomem,
+           live_bytes ? (double)(held * PAGE_SIZE) / live_bytes : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int i;
+
+    if ( argc > 1 && strtoul(argv[1], NULL, 0) )
+        seed = strtoul(argv[1], NULL, 0);
+
+    init_mm();
+    printf("seed %u, %lu pages free, largest free order %d\n\n",
+           seed, nr_free_pages, largest_free_order());
+
+    printf("%-16s %7s %8s %6s %8s %8s %7s %7s  %s\n", "workload", "Mops/s",
+           "ns/op", "live", "pages", "frag", "largest", "nomem", "overhead");
+    for ( i = 0; i < sizeof(page_workloads) / sizeof(page_workloads[0]); i++ )
+        page_bench(&page_workloads[i]);
+    for ( i = 0; i < sizeof(heap_workloads) / sizeof(heap_workloads[0]); i++ )
+        heap_bench(&heap_workloads[i]);
+
+    if ( failures )
+    {
+        printf("\n%lu failures\n", failures);
+        dump_page_allocator();
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * Host page allocator for the allocator tests: every request is a
+ * naturally aligned block from the C heap, so code that finds its
+ * headers by masking addresses behaves as it does in a domain.
+ */
+#include <stdlib.h>
+#include <mini-os/mm.h>
+#include <mini-os/memtag.h>
+
+unsigned long host_pages_in_use;
+unsigned long host_virt_base;
+
+/* Objects are tagged by xmalloc() as in a domain; pages are not. */
+
+unsigned long alloc_pages_tag(int order, unsigned int tag)
+{
+    void *p;
+
+    if ( posix_memalign(&p, PAGE_SIZE << order, PAGE_SIZE << order) )
+        return 0;
+    host_pages_in_use += 1UL << order;
+    return (unsigned long)p;
+}
+
+unsigned long alloc_pages(int order)
+{
+    return alloc_pages_tag(order, mem_tag_current);
+}
+
+void free_pages(void *pointer, int order)
+{
+    host_pages_in_use -= 1UL << order;
+    free(pointer);
+}
+
+void register_shrinker(struct shrinker *s)
+{
+}
+
+void unregister_shrinker(struct shrinker *s)
+{
+}
@@ -0,0 +1,181 @@
+/*
+ * Compare kmem_cache_alloc()/kmem_cache_free() with _xmalloc()/xfree()
+ * for fixed-size objects:
+ *
+ *   make -C hosttest && hosttest/slab-bench
+ *
+ * "batch" allocates a batch of objects and frees it again in reverse;
+ * "churn" keeps a pool of live objects and replaces a random one per
+ * operation, which is what the xmalloc freelist scan is worst at. Each
+ * object is stamped on allocation and checked on free, so overlapping
+ * allocations show up as failures rather than as fast numbers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <mini-os/mm.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/slab.h>
+
+#define BATCH   4096
+#define LIVE    4096
+#define ROUNDS  200
+#define CHURN   (BATCH * ROUNDS)
+
+static const size_t sizes[] = { 32, 64, 128, 256, 512 };
+
+struct alloc_ops {
+    const char *name;
+    void *(*alloc)(void *arg, size_t size);
+    void (*free)(void *arg, void *obj);
+};
+
+static void *xm_alloc(void *arg, size_t size)
+{
+    return _xmalloc(size, DEFAULT_ALIGN);
+}
+
+static void xm_free(void *arg, void *obj)
+{
+    xfree(obj);
+}
+
+static void *slab_alloc(void *arg, size_t size)
+{
+    return kmem_cache_alloc(arg);
+}
+
+static void slab_free(void *arg, void *obj)
+{
+    kmem_cache_free(arg, obj);
+}
+
+static const struct alloc_ops xmalloc_ops = { "xmalloc", xm_alloc, xm_free };
+static const struct alloc_ops slab_ops = { "slab", slab_alloc, slab_free };
+
+static void *objs[LIVE > BATCH ? LIVE : BATCH];
+static unsigned long failures;
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *get(const struct alloc_ops *ops, void *arg, size_t size, int i)
+{
+    void *p = ops->alloc(arg, size);
+
+    if ( p == NULL )
+    {
+        printf("%s: allocation of %zu bytes failed\n", ops->name, size);
+        exit(1);
+    }
+    memset(p, i & 0xff, size);
+    return p;
+}
+
+static void put(const struct alloc_ops *ops, void *arg, void *p, size_t size,
+                int i)
+{
+    const unsigned char *c = p;
+
+    if ( c[0] != (i & 0xff) || c[size - 1] != (i & 0xff) )
+        failures++;
+    ops->free(arg, p);
+}
+
+static double batch(const struct alloc_ops *ops, void *arg, size_t size)
+{
+    double t = now();
+    int r, i;
+
+    for ( r = 0; r < ROUNDS; r++ )
+    {
+        for ( i = 0; i < BATCH; i++ )
+            objs[i] = get(ops, arg, size, i);
+        for ( i = BATCH - 1; i >= 0; i-- )
+            put(ops, arg, objs[i], size, i);
+    }
+    return (now() - t) * 1e9 / (2.0 * BATCH * ROUNDS);
+}
+
+static double churn(const struct alloc_ops *ops, void *arg, size_t size)
+{
+    double t;
+    int n, i;
+
+    for ( i = 0; i < LIVE; i++ )
+        objs[i] = get(ops, arg, size, i);
+
+    t = now();
+    for ( n = 0; n < CHURN; n++ )
+    {
+        i = rnd() % LIVE;
+        put(ops, arg, objs[i], size, i);
+        objs[i] = get(ops, arg, size, i);
+    }
+    t = (now() - t) * 1e9 / (2.0 * CHURN);
+
+    for ( i = 0; i < LIVE; i++ )
+        put(ops, arg, objs[i], size, i);
+    return t;
+}
+
+int main(void)
+{
+    struct kmem_cache *c;
+    double xb, xc, sb, sc;
+    unsigned long xpages, spages;
+    unsigned int i;
+
+    printf("%6s %10s %10s %10s %10s %8s %8s\n", "size", "xm batch",
+           "slab batch", "xm churn", "slab churn", "xm pg", "slab pg");
+    for ( i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++ )
+    {
+        xb = batch(&xmalloc_ops, NULL, sizes[i]);
+        xc = churn(&xmalloc_ops, NULL, sizes[i]);
+
+        /* Pages needed to hold LIVE objects of this size. */
+        xpages = host_pages_in_use;
+        for ( int j = 0; j < LIVE; j++ )
+            objs[j] = get(&xmalloc_ops, NULL, sizes[i], j);
+        xpages = host_pages_in_use - xpages;
+        for ( int j = 0; j < LIVE; j++ )
+            put(&xmalloc_ops, NULL, objs[j], sizes[i], j);
+
+        c = kmem_cache_create("bench", sizes[i], 0, NULL);
+        sb = batch(&slab_ops, c, sizes[i]);
+        sc = churn(&slab_ops, c, sizes[i]);
+
+        spages = host_pages_in_use;
+        for ( int j = 0; j < LIVE; j++ )
+            objs[j] = get(&slab_ops, c, sizes[i], j);
+        spages = host_pages_in_use - spages;
+        for ( int j = 0; j < LIVE; j++ )
+            put(&slab_ops, c, objs[j], sizes[i], j);
+        kmem_cache_destroy(c);
+
+        printf("%6zu %8.1fns %8.1fns %8.1fns %8.1fns %8lu %8lu\n", sizes[i],
+               xb, sb, xc, sc, xpages, spages);
+    }
+
+    if ( failures )
+    {
+        printf("%lu objects were corrupted\n", failures);
+        return 1;
+    }
+    return 0;
+}
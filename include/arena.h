@@ -0,0 +1,35 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <mini-os/types.h>
+
+/*
+ * Region allocator for memory whose lifetime is one request. Objects
+ * are carved from page-backed chunks by bumping a pointer and are never
+ * freed individually; arena_reset() drops them all at once and keeps
+ * the first chunk for the next request, arena_release() gives every
+ * chunk back. An arena may live on the stack: initialise it with
+ * ARENA_INIT or arena_init() and consider its fields opaque.
+ */
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk *chunks;
+    char *cur, *end;
+};
+
+#define ARENA_INIT { NULL, NULL, NULL }
+
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size, size_t align);
+char *arena_strdup(struct arena *a, const char *s);
+void arena_reset(struct arena *a);
+void arena_release(struct arena *a);
+
+/* Allocate space for typed objects in an arena. */
+#define arena_new(_a, _type) \
+    ((_type *)arena_alloc(_a, sizeof(_type), __alignof__(_type)))
+#define arena_new_array(_a, _type, _num) \
+    ((_type *)arena_alloc(_a, sizeof(_type) * (_num), __alignof__(_type)))
+
+#endif /* __ARENA_H__ */
@@ -32,19 +32,29 @@
  */
 #define BALLOON_EMERGENCY_PAGES   64
 
+/* Free memory the background policy leaves in place. */
+#define BALLOON_HEADROOM_PAGES    1024
+
 extern unsigned long nr_max_pages;
 extern unsigned long nr_mem_pages;
+extern unsigned long nr_ballooned_pages;
+extern unsigned long balloon_target;
 
 void get_max_pages(void);
 int balloon_up(unsigned long n_pages);
+int balloon_down(unsigned long n_pages);
+void balloon_set_headroom(unsigned long pages);
+void init_balloon(void);
 
 void mm_alloc_bitmap_remap(void);
 void arch_pfn_add(unsigned long pfn, unsigned long mfn);
+void arch_pfn_remove(unsigned long pfn);
 int chk_free_pages(unsigned long needed);
 
 #else /* CONFIG_BALLOON */
 
 static inline void get_max_pages(void) { }
+static inline void init_balloon(void) { }
 static inline void mm_alloc_bitmap_remap(void) { }
 static inline int chk_free_pages(unsigned long needed)
 {
@@ -0,0 +1,54 @@
+#ifndef __GNTCOPY_H__
+#define __GNTCOPY_H__
+
+#include <mini-os/os.h>
+#include <xen/grant_table.h>
+
+/* Copy operations are submitted to Xen this many at a time. */
+#define GNTCOPY_BATCH 32
+
+/*
+ * One side of a copy: either a frame of our own (ref == GNTCOPY_LOCAL)
+ * or a grant reference of domid, plus the offset within the page.
+ */
+#define GNTCOPY_LOCAL ((grant_ref_t)~0U)
+
+struct gntcopy_ptr {
+    grant_ref_t ref;
+    domid_t domid;
+    unsigned long frame;
+    uint16_t offset;
+};
+
+/*
+ * Please consider struct gntcopy opaque. Segments accumulate in it and
+ * go to Xen when it fills up or on gntcopy_flush().
+ */
+struct gntcopy {
+    int nr;
+    int failed;
+    gnttab_copy_t op[GNTCOPY_BATCH];
+    int16_t *status[GNTCOPY_BATCH];
+};
+
+void
+gntcopy_init(struct gntcopy *c);
+
+int
+gntcopy_add(struct gntcopy *c, const struct gntcopy_ptr *src,
+            const struct gntcopy_ptr *dst, uint16_t len, int16_t *status);
+
+int
+gntcopy_to_ref(struct gntcopy *c, domid_t domid, grant_ref_t ref,
+               uint16_t offset, const void *buf, size_t len,
+               int16_t *status);
+
+int
+gntcopy_from_ref(struct gntcopy *c, void *buf, domid_t domid,
+                 grant_ref_t ref, uint16_t offset, size_t len,
+                 int16_t *status);
+
+int
+gntcopy_flush(struct gntcopy *c);
+
+#endif /* !__GNTCOPY_H__ */
@@ -10,6 +10,11 @@
 struct gntmap {
     int nentries;
     struct gntmap_entry *entries;
+    int nused;
+    int free;
+    int nbuckets;
+    int *buckets;
+    struct gntmap_cache *cache;
 };
 
 int
@@ -26,6 +31,13 @@ gntmap_map_grant_refs(struct gntmap *map,
                       uint32_t *refs,
                       int writable);
 
+int
+gntmap_set_cache(struct gntmap *map, int max_cached);
+
+void
+gntmap_cache_stats(struct gntmap *map, unsigned long *hits,
+                   unsigned long *misses);
+
 void
 gntmap_init(struct gntmap *map);
 
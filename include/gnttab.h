@@ -8,11 +8,41 @@ int gnttab_reset_model(void);
 grant_ref_t gnttab_alloc_and_grant(void **map);
 grant_ref_t gnttab_grant_access(domid_t domid, unsigned long frame,
 				int readonly);
+int gnttab_reserve(unsigned int count);
+void gnttab_unreserve(unsigned int count);
+void gnttab_wait_free(unsigned int count);
+grant_ref_t gnttab_grant_access_reserved(domid_t domid, unsigned long frame,
+					 int readonly);
+int gnttab_grant_access_batch(domid_t domid, const unsigned long *frames,
+			      int n, int readonly, grant_ref_t *refs);
+void gnttab_grant_access_batch_reserved(domid_t domid,
+					const unsigned long *frames, int n,
+					int readonly, grant_ref_t *refs);
+int gnttab_grant_access_subpage(domid_t domid, unsigned long frame,
+				int readonly, unsigned int offset,
+				unsigned int length, grant_ref_t *ref);
+int gnttab_grant_access_transitive(domid_t domid, domid_t trans_domid,
+				   grant_ref_t trans_gref, grant_ref_t *ref);
+int gnttab_get_version(void);
 grant_ref_t gnttab_grant_transfer(domid_t domid, unsigned long pfn);
 unsigned long gnttab_end_transfer(grant_ref_t gref);
+int gnttab_revoke_access(grant_ref_t ref);
+int gnttab_regrant_access(grant_ref_t ref, domid_t domid, unsigned long frame,
+			  int readonly);
 int gnttab_end_access(grant_ref_t ref);
+int gnttab_end_access_batch(const grant_ref_t *refs, int n);
 const char *gnttabop_error(int16_t status);
+void gnttab_dump_stats(void);
+int gnttab_write_stats(const char *path);
 void fini_gnttab(void);
-grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames);
+grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames, int max_grant_frames);
+int arch_grow_gnttab(grant_entry_v1_t *table, int old_frames,
+		     int nr_grant_frames);
+#if __XEN_INTERFACE_VERSION__ >= 0x0003020a
+grant_status_t *arch_init_gnttab_status(int nr_status_frames,
+					int max_status_frames);
+int arch_grow_gnttab_status(grant_status_t *status, int old_frames,
+			    int nr_status_frames);
+#endif
 
 #endif /* !__GNTTAB_H__ */
@@ -0,0 +1,14 @@
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include <mini-os/types.h>
+
+/*
+ * Decode one LZ4 block (the raw block format, no frame header) of
+ * src_len bytes into dst, which has room for dst_len bytes. Returns
+ * the number of bytes written, or -1 if the block is malformed or
+ * does not fit.
+ */
+int lz4_decompress(const void *src, size_t src_len, void *dst, size_t dst_len);
+
+#endif /* _LZ4_H_ */
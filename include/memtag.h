@@ -0,0 +1,66 @@
+#ifndef __MEMTAG_H__
+#define __MEMTAG_H__
+
+/*
+ * Allocation accounting by subsystem. Page allocations and small
+ * xmalloc() blocks are charged to a tag: the one given to
+ * alloc_pages_tag(), or else the running thread's current tag, which
+ * mem_tag_set() changes and new threads inherit. The tag is stored with
+ * the memory, so a free is credited to the right tag whoever does it.
+ * Pages xmalloc() carves small blocks from are charged to MEM_TAG_HEAP;
+ * larger objects are counted once, as pages of the caller's tag.
+ *
+ * Memory allocated before the page tag map exists carries MEM_TAG_NONE
+ * and is never counted.
+ */
+enum mem_tag {
+    MEM_TAG_NONE,
+    MEM_TAG_OTHER,
+    MEM_TAG_HEAP,
+    MEM_TAG_STACK,
+    MEM_TAG_PAGETABLE,
+    MEM_TAG_XENBUS,
+    MEM_TAG_GNTTAB,
+    MEM_TAG_LWIP,
+    MEM_TAG_NNPBACK,
+    NR_MEM_TAGS
+};
+
+struct mem_tag_stats {
+    unsigned long cur;          /* Bytes held now. */
+    unsigned long peak;         /* Most bytes ever held at once. */
+    unsigned long count;        /* Allocations made. */
+};
+
+extern struct mem_tag_stats mem_tag_stats[NR_MEM_TAGS];
+extern unsigned int mem_tag_current;
+
+static inline void mem_tag_charge(unsigned int tag, unsigned long bytes)
+{
+    struct mem_tag_stats *s = &mem_tag_stats[tag];
+
+    s->cur += bytes;
+    s->count++;
+    if ( s->cur > s->peak )
+        s->peak = s->cur;
+}
+
+static inline void mem_tag_credit(unsigned int tag, unsigned long bytes)
+{
+    mem_tag_stats[tag].cur -= bytes;
+}
+
+/* Charge this thread's allocations to tag; returns the previous tag. */
+static inline unsigned int mem_tag_set(unsigned int tag)
+{
+    unsigned int old = mem_tag_current;
+
+    mem_tag_current = tag;
+    return old;
+}
+
+const char *mem_tag_name(unsigned int tag);
+void dump_mem_tags(void);
+int mem_tags_write_stats(const char *path);
+
+#endif /* __MEMTAG_H__ */
@@ -53,9 +53,37 @@ extern unsigned long mm_alloc_bitmap_size;
 
 void init_mm(void);
 unsigned long alloc_pages(int order);
+unsigned long alloc_pages_tag(int order, unsigned int tag);
+unsigned long try_alloc_pages(int order);
 #define alloc_page()    alloc_pages(0)
 void free_pages(void *pointer, int order);
 #define free_page(p)    free_pages(p, 0)
+int largest_free_order(void);
+void dump_page_allocator(void);
+
+/*
+ * Subsystems holding memory they can do without register a shrinker.
+ * Before an allocation fails, and when free memory drops below the low
+ * watermark, shrinkers are called in ascending priority order with the
+ * number of pages still wanted and return how many pages they freed.
+ * They run in the allocating thread and must neither block nor allocate.
+ */
+struct shrinker {
+    const char *name;
+    int priority;
+    unsigned long (*shrink)(struct shrinker *s, unsigned long nr_pages);
+    unsigned long calls, freed;
+    struct shrinker *next;
+};
+
+#define MM_LOW_WATERMARK    128
+#define MM_HIGH_WATERMARK   256
+
+void register_shrinker(struct shrinker *s);
+void unregister_shrinker(struct shrinker *s);
+unsigned long shrink_memory(unsigned long nr_pages);
+void set_mm_watermarks(unsigned long low, unsigned long high);
+unsigned long mm_high_watermark(void);
 
 static __inline__ int get_order(unsigned long size)
 {
@@ -70,6 +98,7 @@ void arch_init_demand_mapping_area(void);
 void arch_init_mm(unsigned long* start_pfn_p, unsigned long* max_pfn_p);
 
 unsigned long allocate_ondemand(unsigned long n, unsigned long alignment);
+void free_ondemand(unsigned long va, unsigned long n);
 /* map f[i*stride]+i*increment for i in 0..n-1, aligned on alignment pages */
 void *map_frames_ex(const unsigned long *f, unsigned long n, unsigned long stride,
 	unsigned long increment, unsigned long alignment, domid_t id,
@@ -6,10 +6,27 @@
 
 struct backend_param
 {
-	float* param_ptr;
+	float* param_ptr;	/* NULL when the model has an lz4 image */
 	int param_size;
 };
 
+/*
+ * Compressed image of a packed model. Block i is an independent LZ4
+ * block that expands to page i of the packed parameters, so pages can
+ * be decompressed in any order straight into their backing page.
+ */
+struct backend_lz4_image
+{
+	const unsigned char *data;
+	const unsigned int *block_offset;	/* nr_blocks + 1 entries */
+	int nr_blocks;
+};
+
+/* Values of /local/domain/backend/<domid>/state */
+#define NNPBACK_STATE_CONNECTED	1	/* grant-ref-ref is published */
+#define NNPBACK_STATE_QUEUED	2	/* waiting for free grant entries */
+#define NNPBACK_STATE_ERROR	3	/* reason is in the error node */
+
 void init_nnpback(void);
 
 void shutdown_nnpback(void);
@@ -18,12 +18,14 @@ struct thread
     MINIOS_TAILQ_ENTRY(struct thread) thread_list;
     uint32_t flags;
     s_time_t wakeup_time;
+    unsigned int mem_tag;   /* See memtag.h, saved while switched out. */
 #ifdef HAVE_LIBC
     struct _reent reent;
 #endif
 };
 
 extern struct thread *idle_thread;
+extern struct kmem_cache *thread_cache;
 void idle_thread_fn(void *unused);
 
 #define RUNNABLE_FLAG   0x00000001
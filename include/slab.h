@@ -0,0 +1,29 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <mini-os/types.h>
+
+/*
+ * Caches of fixed-size objects carved out of single pages. Allocation
+ * and free are O(1) and objects carry no per-object header; the slab an
+ * object belongs to is found by rounding its address down to a page.
+ *
+ * If a constructor is given it runs once per object when its slab is
+ * created, not on every allocation, so objects must be handed back to
+ * kmem_cache_free() in their constructed state.
+ */
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *c);
+
+void *kmem_cache_alloc(struct kmem_cache *c);
+void kmem_cache_free(struct kmem_cache *c, void *obj);
+
+/* Return the cache's empty slabs to the page allocator; returns pages freed. */
+unsigned long kmem_cache_shrink(struct kmem_cache *c);
+
+void kmem_cache_dump(void);
+
+#endif /* __SLAB_H__ */
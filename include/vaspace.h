@@ -0,0 +1,37 @@
+#ifndef __VASPACE_H__
+#define __VASPACE_H__
+
+#include <mini-os/types.h>
+#include <mini-os/list.h>
+
+/*
+ * Allocator for ranges of page-granular virtual address space. Free
+ * space is kept as extents, indexed both by address, so a freed range
+ * merges with its neighbours, and by size class, so an allocation finds
+ * a fitting extent without walking the address space. Allocation and
+ * free cost O(log n) in the number of free extents, however full the
+ * space is.
+ *
+ * Freeing space that is already free is reported and otherwise ignored,
+ * so a stray double unmap cannot corrupt the allocator.
+ */
+#define VA_CLASSES (sizeof(unsigned long) * 8)
+
+struct va_extent;
+
+struct va_space {
+    unsigned long start, end;
+    struct va_extent *root;
+    MINIOS_LIST_HEAD(, struct va_extent) classes[VA_CLASSES];
+    unsigned long class_map;
+    unsigned long free_pages;
+    unsigned long nr_extents;
+};
+
+int va_space_init(struct va_space *vs, unsigned long start, unsigned long end);
+unsigned long va_alloc(struct va_space *vs, unsigned long n,
+                       unsigned long alignment);
+void va_free(struct va_space *vs, unsigned long va, unsigned long n);
+void va_space_dump(struct va_space *vs);
+
+#endif /* __VASPACE_H__ */
@@ -274,6 +274,9 @@ static __inline__ paddr_t machine_to_phys(maddr_t machine)
 #define map_frames(f, n) map_frames_ex(f, n, 1, 0, 1, DOMID_SELF, NULL, L1_PROT)
 #define map_zero(n, a) map_frames_ex(&mfn_zero, n, 0, 0, a, DOMID_SELF, NULL, L1_PROT_RO)
 #define do_map_zero(start, n) do_map_frames(start, &mfn_zero, n, 0, 0, DOMID_SELF, NULL, L1_PROT_RO)
+#ifdef HAVE_LIBC
+void map_heap_pages(unsigned long va, unsigned long n);
+#endif
 
 pgentry_t *need_pgt(unsigned long addr);
 void arch_mm_preinit(void *p);
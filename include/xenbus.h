@@ -28,6 +28,16 @@ static inline void get_xenbus(void *p)
    set to a malloc'd copy of the value. */
 char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value);
 
+/*
+ * The _arena variants of the request helpers take their reply buffers,
+ * results and error strings from arena a instead of the heap; none of
+ * them is to be freed, they go away with the arena. a may be NULL, in
+ * which case they behave exactly like the plain helpers.
+ */
+struct arena;
+char *xenbus_read_arena(xenbus_transaction_t xbt, const char *path,
+                        struct arena *a, char **value);
+
 /* Watch event queue */
 struct xenbus_event {
     /* Keep these two as this for xs.c */
@@ -56,6 +66,8 @@ extern xenbus_event_queue xenbus_events;
 /* Associates a value with a path.  Returns a malloc'd error string on
    failure. */
 char *xenbus_write(xenbus_transaction_t xbt, const char *path, const char *value);
+char *xenbus_write_arena(xenbus_transaction_t xbt, const char *path,
+                         const char *value, struct arena *a);
 
 struct write_req {
     const void *data;
@@ -70,6 +82,12 @@ xenbus_msg_reply(int type,
                  xenbus_transaction_t trans,
                  struct write_req *io,
                  int nr_reqs);
+struct xsd_sockmsg *
+xenbus_msg_reply_arena(int type,
+                       xenbus_transaction_t trans,
+                       struct write_req *io,
+                       int nr_reqs,
+                       struct arena *a);
 
 /* Removes the value associated with a path.  Returns a malloc'd error
    string on failure. */
@@ -80,6 +98,8 @@ char *xenbus_rm(xenbus_transaction_t xbt, const char *path);
    set to a malloc'd array of pointers to malloc'd strings.  The array
    is NULL terminated.  May block. */
 char *xenbus_ls(xenbus_transaction_t xbt, const char *prefix, char ***contents);
+char *xenbus_ls_arena(xenbus_transaction_t xbt, const char *prefix,
+                      struct arena *a, char ***contents);
 
 /* Reads permissions associated with a path.  Returns a malloc'd error
    string on failure and sets *value to NULL.  On success, *value is
@@ -31,6 +31,7 @@
 #include <mini-os/kernel.h>
 #include <mini-os/hypervisor.h>
 #include <mini-os/mm.h>
+#include <mini-os/balloon.h>
 #include <mini-os/events.h>
 #include <mini-os/time.h>
 #include <mini-os/types.h>
@@ -148,6 +149,9 @@ void start_kernel(void)
     create_thread("shutdown", shutdown_thread, NULL);
 #endif
 
+    /* Start returning idle memory to Xen */
+    init_balloon();
+
     /* Call (possibly overridden) app_main() */
     app_main(NULL);
 
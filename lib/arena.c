@@ -0,0 +1,109 @@
+/*
+ * Region allocator, see include/arena.h.
+ *
+ * Chunks are at least a page and come straight from the page allocator.
+ * They are kept newest first, so the chunk arena_reset() holds on to is
+ * the one at the tail: the first, normally single-page, chunk.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/mm.h>
+#include <mini-os/types.h>
+#include <mini-os/lib.h>
+#include <mini-os/arena.h>
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    int order;
+};
+
+static inline unsigned long align_up(unsigned long v, size_t align)
+{
+    return (v + align - 1) & ~(unsigned long)(align - 1);
+}
+
+void arena_init(struct arena *a)
+{
+    a->chunks = NULL;
+    a->cur = a->end = NULL;
+}
+
+static void arena_use_chunk(struct arena *a, struct arena_chunk *c)
+{
+    a->cur = (char *)(c + 1);
+    a->end = (char *)c + (PAGE_SIZE << c->order);
+}
+
+void *arena_alloc(struct arena *a, size_t size, size_t align)
+{
+    struct arena_chunk *c;
+    unsigned long p;
+    int order;
+
+    if ( align < __alignof__(long) )
+        align = __alignof__(long);
+
+    p = align_up((unsigned long)a->cur, align);
+    if ( a->cur && p + size <= (unsigned long)a->end )
+    {
+        a->cur = (char *)(p + size);
+        return (void *)p;
+    }
+
+    /* Current chunk is used up; start a new one big enough for this. */
+    order = get_order(sizeof(*c) + align + size);
+    c = (struct arena_chunk *)alloc_pages(order);
+    if ( c == NULL )
+        return NULL;
+    c->order = order;
+    c->next = a->chunks;
+    a->chunks = c;
+    arena_use_chunk(a, c);
+
+    p = align_up((unsigned long)a->cur, align);
+    a->cur = (char *)(p + size);
+    return (void *)p;
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *d = arena_alloc(a, len, 1);
+
+    if ( d )
+        memcpy(d, s, len);
+    return d;
+}
+
+void arena_reset(struct arena *a)
+{
+    struct arena_chunk *c;
+
+    if ( a->chunks == NULL )
+        return;
+
+    while ( (c = a->chunks)->next != NULL )
+    {
+        a->chunks = c->next;
+        free_pages(c, c->order);
+    }
+    arena_use_chunk(a, c);
+}
+
+void arena_release(struct arena *a)
+{
+    arena_reset(a);
+    if ( a->chunks )
+        free_pages(a->chunks, a->chunks->order);
+    arena_init(a);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,75 @@
+/*
+ * Decoder for the LZ4 block format.
+ *
+ * A block is a sequence of (literals, match) pairs. Each sequence starts
+ * with a token whose high nibble is the literal length and whose low
+ * nibble is the match length minus 4, either extended by 255-valued
+ * bytes when the nibble is 15. Literals are followed by a 16 bit little
+ * endian offset back into the output. The last sequence has no match.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/lz4.h>
+
+static int lz4_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+
+    do {
+        if ( *ip >= iend )
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while ( b == 255 );
+
+    return 0;
+}
+
+int lz4_decompress(const void *src, size_t src_len, void *dst, size_t dst_len)
+{
+    const uint8_t *ip = src, *iend = ip + src_len;
+    uint8_t *op = dst, *oend = op + dst_len;
+    const uint8_t *match;
+    size_t len, offset;
+    uint8_t token;
+
+    while ( ip < iend )
+    {
+        token = *ip++;
+
+        len = token >> 4;
+        if ( len == 15 && lz4_length(&ip, iend, &len) )
+            return -1;
+        if ( len > iend - ip || len > oend - op )
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+
+        /* The last sequence ends with its literals. */
+        if ( ip == iend )
+            break;
+
+        if ( iend - ip < 2 )
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ( offset == 0 || offset > op - (uint8_t *)dst )
+            return -1;
+
+        len = token & 15;
+        if ( len == 15 && lz4_length(&ip, iend, &len) )
+            return -1;
+        len += 4;
+        if ( len > oend - op )
+            return -1;
+
+        /* Matches may overlap the output they produce. */
+        match = op - offset;
+        while ( len-- )
+            *op++ = *match++;
+    }
+
+    return op - (uint8_t *)dst;
+}
@@ -0,0 +1,90 @@
+/*
+ * Allocation accounting by subsystem, see include/memtag.h.
+ *
+ * The counters are updated inline by the allocators; this file only
+ * names the tags and reports them.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/types.h>
+#include <mini-os/lib.h>
+#include <mini-os/errno.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/memtag.h>
+
+struct mem_tag_stats mem_tag_stats[NR_MEM_TAGS];
+unsigned int mem_tag_current = MEM_TAG_OTHER;
+
+static const char *const mem_tag_names[NR_MEM_TAGS] = {
+    [MEM_TAG_NONE]      = "none",
+    [MEM_TAG_OTHER]     = "other",
+    [MEM_TAG_HEAP]      = "heap",
+    [MEM_TAG_STACK]     = "stack",
+    [MEM_TAG_PAGETABLE] = "pagetable",
+    [MEM_TAG_XENBUS]    = "xenbus",
+    [MEM_TAG_GNTTAB]    = "gnttab",
+    [MEM_TAG_LWIP]      = "lwip",
+    [MEM_TAG_NNPBACK]   = "nnpback",
+};
+
+const char *mem_tag_name(unsigned int tag)
+{
+    return tag < NR_MEM_TAGS ? mem_tag_names[tag] : "?";
+}
+
+void dump_mem_tags(void)
+{
+    struct mem_tag_stats *s;
+    unsigned int tag;
+
+    printk("memtag: %-10s %12s %12s %10s\n", "tag", "bytes", "peak", "allocs");
+    for ( tag = MEM_TAG_OTHER; tag < NR_MEM_TAGS; tag++ )
+    {
+        s = &mem_tag_stats[tag];
+        if ( s->count )
+            printk("memtag: %-10s %12lu %12lu %10lu\n",
+                   mem_tag_names[tag], s->cur, s->peak, s->count);
+    }
+}
+
+#ifdef CONFIG_XENBUS
+/* Publish "<bytes> <peak> <allocs>" under path/<tag> for each used tag. */
+int mem_tags_write_stats(const char *path)
+{
+    struct mem_tag_stats *s;
+    unsigned int tag;
+    char *err;
+
+    for ( tag = MEM_TAG_OTHER; tag < NR_MEM_TAGS; tag++ )
+    {
+        s = &mem_tag_stats[tag];
+        if ( !s->count )
+            continue;
+        err = xenbus_printf(XBT_NIL, path, mem_tag_names[tag], "%lu %lu %lu",
+                            s->cur, s->peak, s->count);
+        if ( err )
+        {
+            printk("memtag: cannot write stats to %s: %s\n", path, err);
+            free(err);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+#else
+int mem_tags_write_stats(const char *path)
+{
+    return -ENOSYS;
+}
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
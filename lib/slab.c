@@ -0,0 +1,276 @@
+/*
+ * Slab allocator for fixed-size objects.
+ *
+ * Each slab is one page: a struct kmem_slab at the start followed by as
+ * many objects as fit. Free objects of a slab are chained through a
+ * pointer stored in the object itself, or just past it when the cache
+ * has a constructor so the constructed state survives a free. Slabs
+ * with free objects sit on the cache's partial list; full slabs are on
+ * no list at all, and one empty slab is kept around so that a cache
+ * oscillating around a slab boundary does not hit the page allocator.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/mm.h>
+#include <mini-os/types.h>
+#include <mini-os/lib.h>
+#include <mini-os/list.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/slab.h>
+#include <mini-os/memtag.h>
+
+struct kmem_slab {
+    MINIOS_LIST_ENTRY(struct kmem_slab) list;
+    struct kmem_cache *cache;
+    void *free;
+    unsigned int inuse;
+};
+
+struct kmem_cache {
+    const char *name;
+    size_t size;                /* Object size as requested. */
+    size_t stride;              /* Distance between objects in a slab. */
+    size_t free_off;            /* Offset of the free pointer in an object. */
+    size_t first;               /* Offset of the first object in a slab. */
+    unsigned int per_slab;
+    unsigned int tag;           /* Slab pages are charged to the creator. */
+    void (*ctor)(void *);
+    MINIOS_LIST_HEAD(, struct kmem_slab) partial;
+    struct kmem_slab *empty;
+    unsigned long nr_slabs;
+    unsigned long nr_active;
+    unsigned long nr_allocs;
+    MINIOS_LIST_ENTRY(struct kmem_cache) caches;
+};
+
+static MINIOS_LIST_HEAD(, struct kmem_cache) cache_list =
+    MINIOS_LIST_HEAD_INITIALIZER(cache_list);
+
+static unsigned long slab_shrink(struct shrinker *s, unsigned long nr_pages);
+
+/* Spare empty slabs are the cheapest memory to give back. */
+static struct shrinker slab_shrinker = {
+    .name = "slab",
+    .priority = 0,
+    .shrink = slab_shrink,
+};
+
+#define FREE_PTR(c, obj) (*(void **)((char *)(obj) + (c)->free_off))
+
+static inline size_t align_up(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *))
+{
+    struct kmem_cache *c;
+
+    if ( align < __alignof__(void *) )
+        align = __alignof__(void *);
+    if ( size == 0 || (align & (align - 1)) )
+        return NULL;
+
+    c = xmalloc(struct kmem_cache);
+    if ( c == NULL )
+        return NULL;
+
+    c->name = name;
+    c->size = size;
+    c->tag = mem_tag_current;
+    c->ctor = ctor;
+    if ( ctor )
+    {
+        c->free_off = align_up(size, __alignof__(void *));
+        c->stride = align_up(c->free_off + sizeof(void *), align);
+    }
+    else
+    {
+        c->free_off = 0;
+        c->stride = align_up(size < sizeof(void *) ? sizeof(void *) : size,
+                             align);
+    }
+    c->first = align_up(sizeof(struct kmem_slab), align);
+    if ( c->first >= PAGE_SIZE || c->stride > PAGE_SIZE - c->first )
+    {
+        printk("kmem_cache_create(%s): %lu-byte objects do not fit a slab\n",
+               name, (unsigned long)size);
+        xfree(c);
+        return NULL;
+    }
+    c->per_slab = (PAGE_SIZE - c->first) / c->stride;
+
+    MINIOS_LIST_INIT(&c->partial);
+    c->empty = NULL;
+    c->nr_slabs = 0;
+    c->nr_active = 0;
+    c->nr_allocs = 0;
+    if ( MINIOS_LIST_EMPTY(&cache_list) )
+        register_shrinker(&slab_shrinker);
+    MINIOS_LIST_INSERT_HEAD(&cache_list, c, caches);
+
+    return c;
+}
+
+static struct kmem_slab *kmem_slab_new(struct kmem_cache *c)
+{
+    struct kmem_slab *slab;
+    char *obj;
+    unsigned int i;
+
+    slab = (struct kmem_slab *)alloc_pages_tag(0, c->tag);
+    if ( slab == NULL )
+        return NULL;
+
+    slab->cache = c;
+    slab->inuse = 0;
+    slab->free = NULL;
+
+    /* Chain the objects so they are handed out in address order. */
+    obj = (char *)slab + c->first + (c->per_slab - 1) * c->stride;
+    for ( i = 0; i < c->per_slab; i++, obj -= c->stride )
+    {
+        if ( c->ctor )
+            c->ctor(obj);
+        FREE_PTR(c, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    c->nr_slabs++;
+    return slab;
+}
+
+static void kmem_slab_release(struct kmem_cache *c, struct kmem_slab *slab)
+{
+    c->nr_slabs--;
+    free_page(slab);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c)
+{
+    struct kmem_slab *slab;
+    void *obj;
+
+    slab = MINIOS_LIST_FIRST(&c->partial);
+    if ( slab == NULL )
+    {
+        if ( c->empty )
+        {
+            slab = c->empty;
+            c->empty = NULL;
+        }
+        else
+        {
+            slab = kmem_slab_new(c);
+            if ( slab == NULL )
+                return NULL;
+        }
+        MINIOS_LIST_INSERT_HEAD(&c->partial, slab, list);
+    }
+
+    obj = slab->free;
+    slab->free = FREE_PTR(c, obj);
+    if ( ++slab->inuse == c->per_slab )
+        MINIOS_LIST_REMOVE(slab, list);
+
+    c->nr_active++;
+    c->nr_allocs++;
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+    struct kmem_slab *slab;
+
+    if ( obj == NULL )
+        return;
+
+    slab = (struct kmem_slab *)((unsigned long)obj & PAGE_MASK);
+    BUG_ON(slab->cache != c);
+
+    /* A full slab is on no list; it becomes partial again. */
+    if ( slab->inuse == c->per_slab )
+        MINIOS_LIST_INSERT_HEAD(&c->partial, slab, list);
+
+    FREE_PTR(c, obj) = slab->free;
+    slab->free = obj;
+    c->nr_active--;
+
+    if ( --slab->inuse == 0 )
+    {
+        MINIOS_LIST_REMOVE(slab, list);
+        if ( c->empty )
+            kmem_slab_release(c, slab);
+        else
+            c->empty = slab;
+    }
+}
+
+unsigned long kmem_cache_shrink(struct kmem_cache *c)
+{
+    if ( c->empty == NULL )
+        return 0;
+
+    kmem_slab_release(c, c->empty);
+    c->empty = NULL;
+    return 1;
+}
+
+void kmem_cache_destroy(struct kmem_cache *c)
+{
+    struct kmem_slab *slab, *tmp;
+
+    if ( c == NULL )
+        return;
+
+    if ( c->nr_active )
+        printk("kmem_cache_destroy(%s): %lu objects still in use\n",
+               c->name, c->nr_active);
+    BUG_ON(c->nr_active);
+
+    MINIOS_LIST_FOREACH_SAFE(slab, &c->partial, list, tmp)
+        kmem_slab_release(c, slab);
+    kmem_cache_shrink(c);
+
+    MINIOS_LIST_REMOVE(c, caches);
+    if ( MINIOS_LIST_EMPTY(&cache_list) )
+        unregister_shrinker(&slab_shrinker);
+    xfree(c);
+}
+
+static unsigned long slab_shrink(struct shrinker *s, unsigned long nr_pages)
+{
+    struct kmem_cache *c;
+    unsigned long freed = 0;
+
+    MINIOS_LIST_FOREACH(c, &cache_list, caches)
+    {
+        if ( freed >= nr_pages )
+            break;
+        freed += kmem_cache_shrink(c);
+    }
+    return freed;
+}
+
+void kmem_cache_dump(void)
+{
+    struct kmem_cache *c;
+
+    printk("slab: %-20s %6s %6s %8s %6s %10s\n",
+           "cache", "size", "stride", "active", "slabs", "allocs");
+    MINIOS_LIST_FOREACH(c, &cache_list, caches)
+        printk("slab: %-20s %6lu %6lu %8lu %6lu %10lu\n", c->name,
+               (unsigned long)c->size, (unsigned long)c->stride,
+               c->nr_active, c->nr_slabs, c->nr_allocs);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
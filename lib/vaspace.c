@@ -0,0 +1,339 @@
+/*
+ * Virtual address space allocator, see include/vaspace.h.
+ *
+ * Free extents live in a treap ordered by start address, which gives
+ * predecessor and successor lookups for merging, and on one list per
+ * size class: class c holds extents of 2^c to 2^(c+1)-1 pages. Every
+ * extent in a class above that of n + alignment - 1 pages is certain to
+ * fit a request, so the class bitmap finds one with a single __ffs().
+ * Only when there is none are the smaller extents that might still fit
+ * searched one by one.
+ */
+
+#include <mini-os/errno.h>
+#include <mini-os/os.h>
+#include <mini-os/mm.h>
+#include <mini-os/types.h>
+#include <mini-os/lib.h>
+#include <mini-os/list.h>
+#include <mini-os/slab.h>
+#include <mini-os/vaspace.h>
+
+struct va_extent {
+    unsigned long start, end;
+    struct va_extent *left, *right;
+    unsigned long prio;
+    MINIOS_LIST_ENTRY(struct va_extent) list;
+};
+
+static struct kmem_cache *extent_cache;
+static unsigned long prio_seed = 0x2545f491;
+
+/* Lower-class extents worth trying before falling back to a larger one. */
+#define VA_PROBE 8
+
+static inline unsigned long extent_pages(struct va_extent *e)
+{
+    return (e->end - e->start) >> PAGE_SHIFT;
+}
+
+static inline int size_class(unsigned long pages)
+{
+    return VA_CLASSES - 1 - __builtin_clzl(pages);
+}
+
+static struct va_extent *extent_new(unsigned long start, unsigned long end)
+{
+    struct va_extent *e;
+
+    if ( extent_cache == NULL )
+    {
+        extent_cache = kmem_cache_create("va_extent", sizeof(*e), 0, NULL);
+        if ( extent_cache == NULL )
+            return NULL;
+    }
+    e = kmem_cache_alloc(extent_cache);
+    if ( e == NULL )
+        return NULL;
+
+    e->start = start;
+    e->end = end;
+    e->left = e->right = NULL;
+    prio_seed ^= prio_seed << 13;
+    prio_seed ^= prio_seed >> 7;
+    prio_seed ^= prio_seed << 17;
+    e->prio = prio_seed;
+    return e;
+}
+
+/* Split t into extents starting below key (*l) and the rest (*r). */
+static void treap_split(struct va_extent *t, unsigned long key,
+                        struct va_extent **l, struct va_extent **r)
+{
+    if ( t == NULL )
+    {
+        *l = *r = NULL;
+    }
+    else if ( t->start < key )
+    {
+        treap_split(t->right, key, &t->right, r);
+        *l = t;
+    }
+    else
+    {
+        treap_split(t->left, key, l, &t->left);
+        *r = t;
+    }
+}
+
+/* Join two treaps, every extent of l lying below every extent of r. */
+static struct va_extent *treap_merge(struct va_extent *l, struct va_extent *r)
+{
+    if ( l == NULL )
+        return r;
+    if ( r == NULL )
+        return l;
+    if ( l->prio > r->prio )
+    {
+        l->right = treap_merge(l->right, r);
+        return l;
+    }
+    r->left = treap_merge(l, r->left);
+    return r;
+}
+
+static void extent_link(struct va_space *vs, struct va_extent *e)
+{
+    struct va_extent *l, *r;
+    int c = size_class(extent_pages(e));
+
+    e->left = e->right = NULL;
+    treap_split(vs->root, e->start, &l, &r);
+    vs->root = treap_merge(treap_merge(l, e), r);
+
+    MINIOS_LIST_INSERT_HEAD(&vs->classes[c], e, list);
+    vs->class_map |= 1UL << c;
+    vs->free_pages += extent_pages(e);
+    vs->nr_extents++;
+}
+
+static void extent_unlink(struct va_space *vs, struct va_extent *e)
+{
+    struct va_extent *l, *m, *r;
+    int c = size_class(extent_pages(e));
+
+    treap_split(vs->root, e->start, &l, &r);
+    treap_split(r, e->start + 1, &m, &r);
+    BUG_ON(m != e);
+    vs->root = treap_merge(l, r);
+
+    MINIOS_LIST_REMOVE(e, list);
+    if ( MINIOS_LIST_EMPTY(&vs->classes[c]) )
+        vs->class_map &= ~(1UL << c);
+    vs->free_pages -= extent_pages(e);
+    vs->nr_extents--;
+}
+
+/* The free extent with the highest start at or below va. */
+static struct va_extent *extent_at_or_below(struct va_space *vs,
+                                            unsigned long va)
+{
+    struct va_extent *t = vs->root, *best = NULL;
+
+    while ( t )
+    {
+        if ( t->start <= va )
+        {
+            best = t;
+            t = t->right;
+        }
+        else
+            t = t->left;
+    }
+    return best;
+}
+
+/* The free extent with the lowest start at or above va. */
+static struct va_extent *extent_at_or_above(struct va_space *vs,
+                                            unsigned long va)
+{
+    struct va_extent *t = vs->root, *best = NULL;
+
+    while ( t )
+    {
+        if ( t->start >= va )
+        {
+            best = t;
+            t = t->left;
+        }
+        else
+            t = t->right;
+    }
+    return best;
+}
+
+int va_space_init(struct va_space *vs, unsigned long start, unsigned long end)
+{
+    struct va_extent *e;
+    int c;
+
+    vs->start = start;
+    vs->end = end;
+    vs->root = NULL;
+    for ( c = 0; c < VA_CLASSES; c++ )
+        MINIOS_LIST_INIT(&vs->classes[c]);
+    vs->class_map = 0;
+    vs->free_pages = 0;
+    vs->nr_extents = 0;
+
+    e = extent_new(start, end);
+    if ( e == NULL )
+        return -ENOMEM;
+    extent_link(vs, e);
+    return 0;
+}
+
+static inline unsigned long fit_start(struct va_extent *e, unsigned long n,
+                                      unsigned long align)
+{
+    unsigned long va = (e->start + align - 1) & ~(align - 1);
+
+    if ( va < e->start || va + (n << PAGE_SHIFT) > e->end )
+        return 0;
+    return va;
+}
+
+unsigned long va_alloc(struct va_space *vs, unsigned long n,
+                       unsigned long alignment)
+{
+    struct va_extent *e, *rest;
+    unsigned long align, va = 0, end;
+    unsigned long avail;
+    int c, i, lo;
+
+    if ( n == 0 || (alignment & (alignment - 1)) )
+        return 0;
+    align = (alignment ? alignment : 1) << PAGE_SHIFT;
+
+    /* A few extents of the class that may fit, then any larger one. */
+    c = size_class(n + (alignment ? alignment : 1) - 1);
+    i = 0;
+    MINIOS_LIST_FOREACH(e, &vs->classes[c], list)
+    {
+        if ( (va = fit_start(e, n, align)) || ++i == VA_PROBE )
+            break;
+    }
+    avail = c + 1 < VA_CLASSES ? vs->class_map & ~((2UL << c) - 1) : 0;
+    if ( !va && avail )
+    {
+        e = MINIOS_LIST_FIRST(&vs->classes[__ffs(avail)]);
+        va = fit_start(e, n, align);
+        BUG_ON(!va);
+    }
+    /* Then every extent large enough to fit, depending on alignment. */
+    for ( lo = size_class(n); !va && lo <= c; lo++ )
+    {
+        MINIOS_LIST_FOREACH(e, &vs->classes[lo], list)
+            if ( (va = fit_start(e, n, align)) )
+                break;
+    }
+    if ( !va )
+        return 0;
+
+    /* Carve [va, end) out, keeping what is left on either side. */
+    end = va + (n << PAGE_SHIFT);
+    extent_unlink(vs, e);
+    if ( va > e->start && end < e->end )
+    {
+        rest = extent_new(end, e->end);
+        if ( rest == NULL )
+        {
+            extent_link(vs, e);
+            return 0;
+        }
+        extent_link(vs, rest);
+    }
+    if ( va > e->start )
+    {
+        e->end = va;
+        extent_link(vs, e);
+    }
+    else if ( end < e->end )
+    {
+        e->start = end;
+        extent_link(vs, e);
+    }
+    else
+        kmem_cache_free(extent_cache, e);
+
+    return va;
+}
+
+void va_free(struct va_space *vs, unsigned long va, unsigned long n)
+{
+    struct va_extent *e, *spare = NULL;
+    unsigned long end = va + (n << PAGE_SHIFT);
+
+    if ( n == 0 || va < vs->start || end > vs->end )
+        return;
+
+    /* Absorb the neighbours, and anything overlapping, into [va, end). */
+    e = extent_at_or_below(vs, va);
+    if ( !e || e->end < va )
+        e = extent_at_or_above(vs, va);
+    while ( e && e->start <= end )
+    {
+        if ( e->start < end && e->end > va )
+            printk("va_free: %lx-%lx is partly free already\n", va, end);
+        if ( e->start < va )
+            va = e->start;
+        if ( e->end > end )
+            end = e->end;
+        extent_unlink(vs, e);
+        if ( spare )
+            kmem_cache_free(extent_cache, spare);
+        spare = e;
+        e = extent_at_or_above(vs, va);
+    }
+
+    if ( spare == NULL )
+    {
+        spare = extent_new(va, end);
+        if ( spare == NULL )
+        {
+            printk("va_free: no memory, leaking %lx-%lx\n", va, end);
+            return;
+        }
+    }
+    spare->start = va;
+    spare->end = end;
+    extent_link(vs, spare);
+}
+
+void va_space_dump(struct va_space *vs)
+{
+    int c;
+
+    printk("vaspace %lx-%lx: %lu pages free in %lu extents\n",
+           vs->start, vs->end, vs->free_pages, vs->nr_extents);
+    for ( c = 0; c < VA_CLASSES; c++ )
+    {
+        struct va_extent *e;
+        unsigned long nr = 0;
+
+        MINIOS_LIST_FOREACH(e, &vs->classes[c], list)
+            nr++;
+        if ( nr )
+            printk("  %8lu+ pages: %lu\n", 1UL << c, nr);
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -42,69 +42,198 @@
 #include <mini-os/lib.h>
 #include <mini-os/list.h>
 #include <mini-os/xmalloc.h>
+#include <mini-os/memtag.h>
 
 #ifndef HAVE_LIBC
 /* static spinlock_t freelist_lock = SPIN_LOCK_UNLOCKED; */
 
+/*
+ * Small blocks never cross a page. Every block starts with a boundary
+ * tag giving its own size and that of the block before it in the same
+ * page, so both neighbours are found in O(1) on free. Free blocks sit
+ * on one of NR_CLASSES lists holding blocks of exactly one size, and
+ * free_map has a bit set for every non-empty list, so allocation takes
+ * the smallest fitting free block without scanning.
+ */
 struct xmalloc_hdr
 {
     /* Total including this hdr, unused padding and second hdr. */
     size_t size;
-    MINIOS_TAILQ_ENTRY(struct xmalloc_hdr) freelist;
-} __cacheline_aligned;
+    /* Size of the block before this one in its page, 0 if none. */
+    size_t prev_size;
+};
 
-static MINIOS_TAILQ_HEAD(,struct xmalloc_hdr) freelist =
-	MINIOS_TAILQ_HEAD_INITIALIZER(freelist);
+/* What a free block holds after its hdr. */
+struct xmalloc_free
+{
+    struct xmalloc_hdr hdr;
+    MINIOS_LIST_ENTRY(struct xmalloc_free) freelist;
+};
 
 /* Unused padding data between the two hdrs. */
 
 struct xmalloc_pad
 {
     /* Size including both hdrs. */
-    size_t hdr_size;
+    unsigned int hdr_size;
+    /* Tag the block is charged to, MEM_TAG_NONE for whole pages. */
+    unsigned int tag;
 };
 
+/* Small block sizes are multiples of XMALLOC_GRANULE. */
+#define XMALLOC_GRANULE 16
+#define XMALLOC_FREE    1UL
+#define MIN_BLOCK_SIZE \
+    ((sizeof(struct xmalloc_free) + XMALLOC_GRANULE - 1) & ~(XMALLOC_GRANULE - 1))
+
+#define NR_CLASSES      (PAGE_SIZE / XMALLOC_GRANULE)
+#define BITS_PER_LONG   (sizeof(unsigned long) * 8)
+
+static MINIOS_LIST_HEAD(, struct xmalloc_free) freelist[NR_CLASSES];
+static unsigned long free_map[NR_CLASSES / BITS_PER_LONG];
+
 /* Return size, increased to alignment with align. */
 static inline size_t align_up(size_t size, size_t align)
 {
     return (size + align - 1) & ~(align - 1);
 }
 
-static void maybe_split(struct xmalloc_hdr *hdr, size_t size, size_t block)
+static inline size_t block_size(struct xmalloc_hdr *hdr)
 {
-    struct xmalloc_hdr *extra;
-    size_t leftover;
-    size = align_up(size, __alignof__(struct xmalloc_hdr));
-    size = align_up(size, __alignof__(struct xmalloc_pad));
-    leftover = block - size;
+    return hdr->size & ~XMALLOC_FREE;
+}
 
-    /* If enough is left to make a block, put it on free list. */
-    if ( leftover >= (2 * (sizeof(struct xmalloc_hdr) + sizeof(struct xmalloc_pad))) )
+static inline int size_class(size_t size)
+{
+    return size / XMALLOC_GRANULE - 1;
+}
+
+/* The block after hdr in its page, NULL if hdr ends the page. */
+static inline struct xmalloc_hdr *next_block(struct xmalloc_hdr *hdr)
+{
+    unsigned long next = (unsigned long)hdr + block_size(hdr);
+
+    return (next & ~PAGE_MASK) ? (struct xmalloc_hdr *)next : NULL;
+}
+
+static inline struct xmalloc_hdr *prev_block(struct xmalloc_hdr *hdr)
+{
+    return hdr->prev_size ?
+        (struct xmalloc_hdr *)((unsigned long)hdr - hdr->prev_size) : NULL;
+}
+
+/* Set the size of hdr and the tag of the block following it. */
+static void set_size(struct xmalloc_hdr *hdr, size_t size, unsigned long flags)
+{
+    struct xmalloc_hdr *next;
+
+    hdr->size = size | flags;
+    if ( (next = next_block(hdr)) != NULL )
+        next->prev_size = size;
+}
+
+static void freelist_add(struct xmalloc_hdr *hdr, size_t size)
+{
+    struct xmalloc_free *f = (struct xmalloc_free *)hdr;
+    int c = size_class(size);
+
+    set_size(hdr, size, XMALLOC_FREE);
+    MINIOS_LIST_INSERT_HEAD(&freelist[c], f, freelist);
+    free_map[c / BITS_PER_LONG] |= 1UL << (c % BITS_PER_LONG);
+}
+
+static void freelist_del(struct xmalloc_hdr *hdr)
+{
+    struct xmalloc_free *f = (struct xmalloc_free *)hdr;
+    int c = size_class(block_size(hdr));
+
+    MINIOS_LIST_REMOVE(f, freelist);
+    if ( MINIOS_LIST_EMPTY(&freelist[c]) )
+        free_map[c / BITS_PER_LONG] &= ~(1UL << (c % BITS_PER_LONG));
+    hdr->size &= ~XMALLOC_FREE;
+}
+
+/* Smallest free block of at least size bytes, still on its list. */
+static struct xmalloc_hdr *find_free(size_t size)
+{
+    unsigned int c = size_class(size);
+    unsigned int w = c / BITS_PER_LONG;
+    unsigned long bits = free_map[w] & (~0UL << (c % BITS_PER_LONG));
+
+    while ( !bits )
+    {
+        if ( ++w == NR_CLASSES / BITS_PER_LONG )
+            return NULL;
+        bits = free_map[w];
+    }
+    c = w * BITS_PER_LONG + __ffs(bits);
+    return &MINIOS_LIST_FIRST(&freelist[c])->hdr;
+}
+
+/*
+ * Give a block back, merging it with free neighbours. A block that
+ * grows to the whole page goes back to the page allocator.
+ */
+static void free_block(struct xmalloc_hdr *hdr)
+{
+    struct xmalloc_hdr *next, *prev;
+    size_t size = block_size(hdr);
+
+    if ( (next = next_block(hdr)) != NULL && (next->size & XMALLOC_FREE) )
+    {
+        freelist_del(next);
+        size += block_size(next);
+    }
+    if ( (prev = prev_block(hdr)) != NULL && (prev->size & XMALLOC_FREE) )
     {
-        extra = (struct xmalloc_hdr *)((unsigned long)hdr + size);
-        extra->size = leftover;
-        /* spin_lock_irqsave(&freelist_lock, flags); */
-        MINIOS_TAILQ_INSERT_HEAD(&freelist, extra, freelist);
-        /* spin_unlock_irqrestore(&freelist_lock, flags); */
+        freelist_del(prev);
+        size += block_size(prev);
+        hdr = prev;
     }
-    else
+
+    if ( size == PAGE_SIZE )
     {
-        size = block;
+        BUG_ON((unsigned long)hdr & ~PAGE_MASK);
+        free_page(hdr);
+        return;
     }
 
+    /* spin_lock_irqsave(&freelist_lock, flags); */
+    freelist_add(hdr, size);
+    /* spin_unlock_irqrestore(&freelist_lock, flags); */
+}
+
+/* Trim an allocated block to size bytes, freeing the tail if possible. */
+static void maybe_split(struct xmalloc_hdr *hdr, size_t size)
+{
+    struct xmalloc_hdr *extra;
+    size_t block = block_size(hdr);
+
+    size = align_up(size, XMALLOC_GRANULE);
+    if ( size < MIN_BLOCK_SIZE )
+        size = MIN_BLOCK_SIZE;
+
+    /* If enough is left to make a block, put it on free list. */
+    if ( block < size + MIN_BLOCK_SIZE )
+        return;
+
+    extra = (struct xmalloc_hdr *)((unsigned long)hdr + size);
+    extra->prev_size = size;
+    set_size(extra, block - size, 0);
     hdr->size = size;
+    free_block(extra);
 }
 
-static struct xmalloc_hdr *xmalloc_new_page(size_t size)
+static struct xmalloc_hdr *xmalloc_new_page(void)
 {
     struct xmalloc_hdr *hdr;
-    /* unsigned long flags; */
 
-    hdr = (struct xmalloc_hdr *)alloc_page();
+    hdr = (struct xmalloc_hdr *)alloc_pages_tag(0, MEM_TAG_HEAP);
     if ( hdr == NULL )
         return NULL;
 
-    maybe_split(hdr, size, PAGE_SIZE);
+    hdr->size = PAGE_SIZE;
+    hdr->prev_size = 0;
 
     return hdr;
 }
@@ -132,14 +261,15 @@ static void *xmalloc_whole_pages(size_t size, size_t align)
     ret = (char*)hdr + hdr_size;
     pad = (struct xmalloc_pad *) ret - 1;
     pad->hdr_size = hdr_size;
+    pad->tag = MEM_TAG_NONE;
     return ret;
 }
 
 void *_xmalloc(size_t size, size_t align)
 {
-    struct xmalloc_hdr *i, *tmp, *hdr = NULL;
+    struct xmalloc_hdr *hdr, *new_hdr;
     uintptr_t data_begin;
-    size_t hdr_size;
+    size_t hdr_size, need, front;
     /* unsigned long flags; */
 
     hdr_size = sizeof(struct xmalloc_hdr) + sizeof(struct xmalloc_pad);
@@ -151,55 +281,58 @@ void *_xmalloc(size_t size, size_t align)
     if ( size + align_up(hdr_size, align) >= PAGE_SIZE )
         return xmalloc_whole_pages(size, align);
 
-    /* Search free list. */
-    /* spin_lock_irqsave(&freelist_lock, flags); */
-    MINIOS_TAILQ_FOREACH_SAFE(i, &freelist, freelist, tmp)
-    {
-        data_begin = align_up((uintptr_t)i + hdr_size, align);
-
-        if ( data_begin + size > (uintptr_t)i + i->size )
-            continue;
-
-        MINIOS_TAILQ_REMOVE(&freelist, i, freelist);
-        /* spin_unlock_irqrestore(&freelist_lock, flags); */
+    /* An empty block could end on the page boundary its data starts at. */
+    if ( size == 0 )
+        size = 1;
+
+    /*
+     * Blocks start on a granule, so any block this large can hold the
+     * data at the requested alignment.
+     */
+    need = align_up(align_up(hdr_size, align) + size, XMALLOC_GRANULE);
+    if ( align > XMALLOC_GRANULE )
+        need += align - XMALLOC_GRANULE;
+    if ( need < MIN_BLOCK_SIZE )
+        need = MIN_BLOCK_SIZE;
+    if ( need > PAGE_SIZE )
+        return xmalloc_whole_pages(size, align);
 
-        uintptr_t size_before = (data_begin - hdr_size) - (uintptr_t)i;
+    /* spin_lock_irqsave(&freelist_lock, flags); */
+    hdr = find_free(need);
+    if ( hdr )
+        freelist_del(hdr);
+    /* spin_unlock_irqrestore(&freelist_lock, flags); */
 
-        if (size_before >= 2 * hdr_size) {
-            /* Worth splitting the beginning */
-            struct xmalloc_hdr *new_i = (void*)(data_begin - hdr_size);
-            new_i->size = i->size - size_before;
-            i->size = size_before;
-            /* spin_lock_irqsave(&freelist_lock, flags); */
-            MINIOS_TAILQ_INSERT_HEAD(&freelist, i, freelist);
-            /* spin_unlock_irqrestore(&freelist_lock, flags); */
-            i = new_i;
-        }
-        maybe_split(i, (data_begin + size) - (uintptr_t)i, i->size);
-        hdr = i;
-        break;
-    }
+    /* Alloc a new page and return from that. */
+    if ( hdr == NULL && (hdr = xmalloc_new_page()) == NULL )
+        return NULL;
 
-    if (!hdr) {
-        /* spin_unlock_irqrestore(&freelist_lock, flags); */
+    data_begin = align_up((uintptr_t)hdr + hdr_size, align);
 
-        /* Alloc a new page and return from that. */
-        hdr = xmalloc_new_page(align_up(hdr_size, align) + size);
-        if ( hdr == NULL )
-            return NULL;
-        data_begin = (uintptr_t)hdr + align_up(hdr_size, align);
+    /* Worth splitting the beginning? */
+    front = (data_begin - hdr_size - (uintptr_t)hdr) & ~(XMALLOC_GRANULE - 1);
+    if ( front >= MIN_BLOCK_SIZE )
+    {
+        new_hdr = (struct xmalloc_hdr *)((uintptr_t)hdr + front);
+        new_hdr->prev_size = front;
+        set_size(new_hdr, block_size(hdr) - front, 0);
+        hdr->size = front;
+        free_block(hdr);
+        hdr = new_hdr;
     }
+    maybe_split(hdr, (data_begin + size) - (uintptr_t)hdr);
 
     struct xmalloc_pad *pad = (struct xmalloc_pad *) data_begin - 1;
     pad->hdr_size = data_begin - (uintptr_t)hdr;
+    pad->tag = mem_tag_current;
+    mem_tag_charge(pad->tag, block_size(hdr));
     BUG_ON(data_begin % align);
     return (void*)data_begin;
 }
 
 void xfree(const void *p)
 {
-    /* unsigned long flags; */
-    struct xmalloc_hdr *i, *tmp, *hdr;
+    struct xmalloc_hdr *hdr;
     struct xmalloc_pad *pad;
 
     if ( p == NULL )
@@ -208,9 +341,11 @@ void xfree(const void *p)
     pad = (struct xmalloc_pad *)p - 1;
     hdr = (struct xmalloc_hdr *)((char *)p - pad->hdr_size);
 
-    /* Big allocs free directly. */
+    /* Big allocs, and small ones that took a whole page, free directly. */
     if ( hdr->size >= PAGE_SIZE )
     {
+        if ( pad->tag != MEM_TAG_NONE )
+            mem_tag_credit(pad->tag, hdr->size);
         free_pages(hdr, get_order(hdr->size));
         return;
     }
@@ -222,49 +357,8 @@ void xfree(const void *p)
         *(int*)0=0;
     }
 
-    /* Merge with other free block, or put in list. */
-    /* spin_lock_irqsave(&freelist_lock, flags); */
-    MINIOS_TAILQ_FOREACH_SAFE(i, &freelist, freelist, tmp)
-    {
-        unsigned long _i   = (unsigned long)i;
-        unsigned long _hdr = (unsigned long)hdr;
-
-        /* Do not merge across page boundaries. */
-        if ( ((_i ^ _hdr) & PAGE_MASK) != 0 )
-            continue;
-
-        /* We follow this block?  Swallow it. */
-        if ( (_i + i->size) == _hdr )
-        {
-            MINIOS_TAILQ_REMOVE(&freelist, i, freelist);
-            i->size += hdr->size;
-            hdr = i;
-        }
-
-        /* We precede this block? Swallow it. */
-        if ( (_hdr + hdr->size) == _i )
-        {
-            MINIOS_TAILQ_REMOVE(&freelist, i, freelist);
-            hdr->size += i->size;
-        }
-    }
-
-    /* Did we merge an entire page? */
-    if ( hdr->size == PAGE_SIZE )
-    {
-        if((((unsigned long)hdr) & (PAGE_SIZE-1)) != 0)
-        {
-            printk("Bug\n");
-            *(int*)0=0;
-        }
-        free_page(hdr);
-    }
-    else
-    {
-        MINIOS_TAILQ_INSERT_HEAD(&freelist, hdr, freelist);
-    }
-
-    /* spin_unlock_irqrestore(&freelist_lock, flags); */
+    mem_tag_credit(pad->tag, block_size(hdr));
+    free_block(hdr);
 }
 
 void *malloc(size_t size)
@@ -277,7 +371,7 @@ void *realloc(void *ptr, size_t size)
     void *new;
     struct xmalloc_hdr *hdr;
     struct xmalloc_pad *pad;
-    size_t old_data_size;
+    size_t old_data_size, block;
 
     if (ptr == NULL)
         return _xmalloc(size, DEFAULT_ALIGN);
@@ -288,7 +382,12 @@ void *realloc(void *ptr, size_t size)
     old_data_size = hdr->size - pad->hdr_size;
     if ( old_data_size >= size )
     {
-	maybe_split(hdr, pad->hdr_size + size, hdr->size);
+        if ( hdr->size < PAGE_SIZE )
+        {
+            block = block_size(hdr);
+            maybe_split(hdr, pad->hdr_size + (size ? size : 1));
+            mem_tag_credit(pad->tag, block - block_size(hdr));
+        }
         return ptr;
     }
     
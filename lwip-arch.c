@@ -10,19 +10,29 @@
 #include <time.h>
 #include <console.h>
 #include <xmalloc.h>
+#include <slab.h>
+#include <memtag.h>
 #include <lwip/sys.h>
 #include <stdarg.h>
 
+static struct kmem_cache *sem_cache;
+static struct kmem_cache *mbox_cache;
+
 /* Is called to initialize the sys_arch layer */
 void sys_init(void)
 {
+    sem_cache = kmem_cache_create("lwip-sem", sizeof(struct semaphore),
+                                  __alignof__(struct semaphore), NULL);
+    mbox_cache = kmem_cache_create("lwip-mbox", sizeof(struct mbox),
+                                   __alignof__(struct mbox), NULL);
+    BUG_ON(sem_cache == NULL || mbox_cache == NULL);
 }
 
 /* Creates and returns a new semaphore. The "count" argument specifies
  * the initial state of the semaphore. */
 sys_sem_t sys_sem_new(uint8_t count)
 {
-    struct semaphore *sem = xmalloc(struct semaphore);
+    struct semaphore *sem = kmem_cache_alloc(sem_cache);
     sem->count = count;
     init_waitqueue_head(&sem->wait);
     return sem;
@@ -31,7 +41,7 @@ sys_sem_t sys_sem_new(uint8_t count)
 /* Deallocates a semaphore. */
 void sys_sem_free(sys_sem_t sem)
 {
-    xfree(sem);
+    kmem_cache_free(sem_cache, sem);
 }
 
 /* Signals a semaphore. */
@@ -86,7 +96,7 @@ uint32_t sys_arch_sem_wait(sys_sem_t sem, uint32_t timeout)
 /* Creates an empty mailbox. */
 sys_mbox_t sys_mbox_new(int size)
 {
-    struct mbox *mbox = xmalloc(struct mbox);
+    struct mbox *mbox = kmem_cache_alloc(mbox_cache);
     if (!size)
         size = 32;
     else if (size == 1)
@@ -107,7 +117,7 @@ void sys_mbox_free(sys_mbox_t mbox)
 {
     ASSERT(mbox->reader == mbox->writer);
     xfree(mbox->messages);
-    xfree(mbox);
+    kmem_cache_free(mbox_cache, mbox);
 }
 
 /* Posts the "msg" to the mailbox, internal version that actually does the
@@ -241,6 +251,7 @@ sys_thread_t sys_thread_new(char *name, void (* thread)(void *arg), void *arg, i
         do_exit();
     }
     lwip_thread = t = create_thread(name, thread, arg);
+    t->mem_tag = MEM_TAG_LWIP;
     return t;
 }
 
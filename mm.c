@@ -44,6 +44,7 @@
 #include <mini-os/lib.h>
 #include <mini-os/xmalloc.h>
 #include <mini-os/e820.h>
+#include <mini-os/memtag.h>
 
 /*********************
  * ALLOCATION BITMAP
@@ -142,6 +143,41 @@ static chunk_head_t *free_head[FREELIST_SIZE];
 static chunk_head_t  free_tail[FREELIST_SIZE];
 #define FREELIST_EMPTY(_l) ((_l)->next == NULL)
 
+/*
+ * Bit i of free_orders is set iff free_head[i] is non-empty, so the
+ * smallest order able to satisfy a request is a single __ffs() away.
+ * free_chunks[] counts the chunks on each list and alloc_failures[]
+ * counts requests of each order that could not be satisfied.
+ */
+static unsigned long free_orders;
+static unsigned long free_chunks[FREELIST_SIZE];
+static unsigned long alloc_failures[FREELIST_SIZE];
+
+static void link_chunk(chunk_head_t *ch, int order)
+{
+    chunk_tail_t *ct;
+
+    ct = (chunk_tail_t *)((char *)ch + (1UL << (order + PAGE_SHIFT))) - 1;
+    ch->level       = order;
+    ch->next        = free_head[order];
+    ch->pprev       = &free_head[order];
+    ch->next->pprev = &ch->next;
+    free_head[order] = ch;
+    ct->level       = order;
+
+    free_chunks[order]++;
+    free_orders |= 1UL << order;
+}
+
+static void unlink_chunk(chunk_head_t *ch, int order)
+{
+    *(ch->pprev) = ch->next;
+    ch->next->pprev = ch->pprev;
+
+    if ( --free_chunks[order] == 0 )
+        free_orders &= ~(1UL << order);
+}
+
 /*
  * Initialise allocator, placing addresses [@min,@max] in free pool.
  * @min and @max are PHYSICAL addresses.
@@ -152,7 +188,6 @@ static void init_page_allocator(unsigned long min, unsigned long max)
     unsigned long range;
     unsigned long r_min, r_max;
     chunk_head_t *ch;
-    chunk_tail_t *ct;
 
     printk("MM: Initialise page allocator for %lx(%lx)-%lx(%lx)\n",
            (u_long)to_virt(min), min, (u_long)to_virt(max), max);
@@ -199,7 +234,7 @@ static void init_page_allocator(unsigned long min, unsigned long max)
         range = r_max - r_min;
 
         /* Free up the memory we've been given to play with. */
-        map_free(PHYS_PFN(r_min), range >> PAGE_SHIFT);
+        map_free(virt_to_pfn(r_min), range >> PAGE_SHIFT);
 
         while ( range != 0 )
         {
@@ -213,14 +248,7 @@ static void init_page_allocator(unsigned long min, unsigned long max)
             ch = (chunk_head_t *)r_min;
             r_min += 1UL << i;
             range -= 1UL << i;
-            ct = (chunk_tail_t *)r_min - 1;
-            i -= PAGE_SHIFT;
-            ch->level       = i;
-            ch->next        = free_head[i];
-            ch->pprev       = &free_head[i];
-            ch->next->pprev = &ch->next;
-            free_head[i]    = ch;
-            ct->level       = i;
+            link_chunk(ch, i - PAGE_SHIFT);
         }
     }
 
@@ -228,113 +256,240 @@ static void init_page_allocator(unsigned long min, unsigned long max)
 }
 
 
-/* Allocate 2^@order contiguous pages. Returns a VIRTUAL address. */
-unsigned long alloc_pages(int order)
+/*
+ * Shrinkers sorted by priority. Reclaim is started when free memory
+ * falls below low_watermark and tries to bring it back to high_watermark.
+ */
+static struct shrinker *shrinkers;
+static unsigned long low_watermark = MM_LOW_WATERMARK;
+static unsigned long high_watermark = MM_HIGH_WATERMARK;
+static int in_shrink;
+
+/* Tag of each allocated block, kept at its first page. */
+static unsigned char *page_tags;
+static unsigned long nr_page_tags;
+
+void register_shrinker(struct shrinker *s)
+{
+    struct shrinker **pp = &shrinkers;
+
+    while ( *pp && (*pp)->priority <= s->priority )
+        pp = &(*pp)->next;
+    s->calls = s->freed = 0;
+    s->next = *pp;
+    *pp = s;
+}
+
+void unregister_shrinker(struct shrinker *s)
+{
+    struct shrinker **pp;
+
+    for ( pp = &shrinkers; *pp; pp = &(*pp)->next )
+    {
+        if ( *pp == s )
+        {
+            *pp = s->next;
+            break;
+        }
+    }
+}
+
+void set_mm_watermarks(unsigned long low, unsigned long high)
+{
+    low_watermark = low;
+    high_watermark = high < low ? low : high;
+}
+
+unsigned long mm_high_watermark(void)
+{
+    return high_watermark;
+}
+
+/* Ask the shrinkers for nr_pages pages; returns how many were freed. */
+unsigned long shrink_memory(unsigned long nr_pages)
+{
+    struct shrinker *s;
+    unsigned long n, freed = 0;
+
+    /* Shrinkers may take locks; never run them from interrupt context. */
+    if ( in_shrink || irqs_disabled() )
+        return 0;
+
+    in_shrink = 1;
+    for ( s = shrinkers; s && freed < nr_pages; s = s->next )
+    {
+        n = s->shrink(s, nr_pages - freed);
+        s->calls++;
+        s->freed += n;
+        freed += n;
+    }
+    in_shrink = 0;
+
+    return freed;
+}
+
+/* Take 2^@order pages from the free lists as they are now, or return 0. */
+static unsigned long take_pages(int order, unsigned int tag)
 {
     int i;
+    unsigned long avail, pfn;
     chunk_head_t *alloc_ch, *spare_ch;
-    chunk_tail_t            *spare_ct;
-
-    if ( !chk_free_pages(1UL << order) )
-        goto no_memory;
 
     /* Find smallest order which can satisfy the request. */
-    for ( i = order; i < FREELIST_SIZE; i++ ) {
-	if ( !FREELIST_EMPTY(free_head[i]) ) 
-	    break;
-    }
+    avail = free_orders & ~((1UL << order) - 1);
+    if ( !avail )
+        return 0;
+    i = __ffs(avail);
 
-    if ( i == FREELIST_SIZE ) goto no_memory;
- 
     /* Unlink a chunk. */
     alloc_ch = free_head[i];
-    free_head[i] = alloc_ch->next;
-    alloc_ch->next->pprev = alloc_ch->pprev;
+    unlink_chunk(alloc_ch, i);
 
     /* We may have to break the chunk a number of times. */
     while ( i != order )
     {
-        /* Split into two equal parts. */
+        /* Split into two equal parts; the upper half goes back on a list. */
         i--;
         spare_ch = (chunk_head_t *)((char *)alloc_ch + (1UL<<(i+PAGE_SHIFT)));
-        spare_ct = (chunk_tail_t *)((char *)spare_ch + (1UL<<(i+PAGE_SHIFT)))-1;
-
-        /* Create new header for spare chunk. */
-        spare_ch->level = i;
-        spare_ch->next  = free_head[i];
-        spare_ch->pprev = &free_head[i];
-        spare_ct->level = i;
-
-        /* Link in the spare chunk. */
-        spare_ch->next->pprev = &spare_ch->next;
-        free_head[i] = spare_ch;
+        link_chunk(spare_ch, i);
     }
     
-    map_alloc(PHYS_PFN(to_phys(alloc_ch)), 1UL<<order);
+    pfn = PHYS_PFN(to_phys(alloc_ch));
+    map_alloc(pfn, 1UL<<order);
+    if ( pfn < nr_page_tags && tag != MEM_TAG_NONE )
+    {
+        page_tags[pfn] = tag;
+        mem_tag_charge(tag, PAGE_SIZE << order);
+    }
+
+    /* Reclaim once on crossing the low watermark, not on every request. */
+    if ( nr_free_pages < low_watermark &&
+         nr_free_pages + (1UL << order) >= low_watermark )
+        shrink_memory(high_watermark - nr_free_pages);
 
     return((unsigned long)alloc_ch);
+}
+
+/*
+ * Allocate 2^@order contiguous pages, charged to tag. Returns a VIRTUAL
+ * address.
+ */
+unsigned long alloc_pages_tag(int order, unsigned int tag)
+{
+    unsigned long va;
+
+    if ( order < 0 || order >= FREELIST_SIZE )
+        goto no_memory;
+
+ retry:
+    if ( !chk_free_pages(1UL << order) )
+        goto reclaim;
+    va = take_pages(order, tag);
+    if ( va )
+        return va;
+
+ reclaim:
+    /* Every pass frees something, so this ends when the shrinkers run dry. */
+    if ( shrink_memory(1UL << order) )
+        goto retry;
 
  no_memory:
 
-    printk("Cannot handle page request order %d!\n", order);
+    if ( order >= 0 && order < FREELIST_SIZE )
+        alloc_failures[order]++;
+    printk("Cannot handle page request order %d (%lu pages free, largest "
+           "free order %d)!\n", order, nr_free_pages, largest_free_order());
 
     return 0;
 }
 
+unsigned long alloc_pages(int order)
+{
+    return alloc_pages_tag(order, mem_tag_current);
+}
+
+/*
+ * Like alloc_pages(), but only from what is free right now: a failure
+ * neither balloons up nor reclaims, and is neither logged nor counted.
+ * For callers that probe for large blocks and can make do with smaller.
+ */
+unsigned long try_alloc_pages(int order)
+{
+    if ( order < 0 || order >= FREELIST_SIZE )
+        return 0;
+    return take_pages(order, mem_tag_current);
+}
+
 void free_pages(void *pointer, int order)
 {
     chunk_head_t *freed_ch, *to_merge_ch;
-    chunk_tail_t *freed_ct;
-    unsigned long mask;
+    unsigned long mask, pfn = virt_to_pfn(pointer);
+
+    if ( pfn < nr_page_tags && page_tags[pfn] != MEM_TAG_NONE )
+    {
+        mem_tag_credit(page_tags[pfn], PAGE_SIZE << order);
+        page_tags[pfn] = MEM_TAG_NONE;
+    }
     
     /* First free the chunk */
-    map_free(virt_to_pfn(pointer), 1UL << order);
+    map_free(pfn, 1UL << order);
     
-    /* Create free chunk */
     freed_ch = (chunk_head_t *)pointer;
-    freed_ct = (chunk_tail_t *)((char *)pointer + (1UL<<(order + PAGE_SHIFT)))-1;
     
     /* Now, possibly we can conseal chunks together */
-    while(order < FREELIST_SIZE)
+    while ( order < FREELIST_SIZE - 1 )
     {
         mask = 1UL << (order + PAGE_SHIFT);
-        if((unsigned long)freed_ch & mask) 
-        {
-            to_merge_ch = (chunk_head_t *)((char *)freed_ch - mask);
-            if(allocated_in_map(virt_to_pfn(to_merge_ch)) ||
-                    to_merge_ch->level != order)
-                break;
-            
-            /* Merge with predecessor */
-            freed_ch = to_merge_ch;   
-        }
-        else 
-        {
-            to_merge_ch = (chunk_head_t *)((char *)freed_ch + mask);
-            if(allocated_in_map(virt_to_pfn(to_merge_ch)) ||
-                    to_merge_ch->level != order)
-                break;
-            
-            /* Merge with successor */
-            freed_ct = (chunk_tail_t *)((char *)to_merge_ch + mask) - 1;
-        }
-        
-        /* We are commited to merging, unlink the chunk */
-        *(to_merge_ch->pprev) = to_merge_ch->next;
-        to_merge_ch->next->pprev = to_merge_ch->pprev;
+        to_merge_ch = (chunk_head_t *)((unsigned long)freed_ch ^ mask);
+        if ( allocated_in_map(virt_to_pfn(to_merge_ch)) ||
+             to_merge_ch->level != order )
+            break;
+
+        /* We are commited to merging, unlink the buddy */
+        unlink_chunk(to_merge_ch, order);
+        if ( (unsigned long)freed_ch & mask )
+            freed_ch = to_merge_ch;
         
         order++;
     }
 
     /* Link the new chunk */
-    freed_ch->level = order;
-    freed_ch->next  = free_head[order];
-    freed_ch->pprev = &free_head[order];
-    freed_ct->level = order;
-    
-    freed_ch->next->pprev = &freed_ch->next;
-    free_head[order] = freed_ch;   
-   
+    link_chunk(freed_ch, order);
+}
+
+/* Order of the largest free chunk, or -1 if no memory is free at all. */
+int largest_free_order(void)
+{
+    int i;
+
+    for ( i = FREELIST_SIZE - 1; i >= 0; i-- )
+        if ( free_orders & (1UL << i) )
+            return i;
+    return -1;
+}
+
+void dump_page_allocator(void)
+{
+    struct shrinker *s;
+    int i;
+
+    printk("MM: %lu pages free, largest free order %d\n",
+           nr_free_pages, largest_free_order());
+    printk("    order  chunks      pages   failures\n");
+    for ( i = 0; i < FREELIST_SIZE; i++ )
+    {
+        if ( !free_chunks[i] && !alloc_failures[i] )
+            continue;
+        printk("    %5d %7lu %10lu %10lu\n", i, free_chunks[i],
+               free_chunks[i] << i, alloc_failures[i]);
+    }
+
+    printk("MM: watermarks %lu/%lu pages\n", low_watermark, high_watermark);
+    for ( s = shrinkers; s; s = s->next )
+        printk("    %-20s prio %3d %8lu calls %10lu pages freed\n",
+               s->name, s->priority, s->calls, s->freed);
+
+    dump_mem_tags();
 }
 
 int free_physical_pages(xen_pfn_t *mfns, int n)
@@ -371,13 +526,13 @@ void *sbrk(ptrdiff_t increment)
     if (new_brk > heap_mapped) {
         unsigned long n = (new_brk - heap_mapped + PAGE_SIZE - 1) / PAGE_SIZE;
 
-        if ( !chk_free_pages(n) )
+        if ( !chk_free_pages(n) && !(shrink_memory(n) && chk_free_pages(n)) )
         {
             printk("Memory exhausted: want %ld pages, but only %ld are left\n",
                    n, nr_free_pages);
             return NULL;
         }
-        do_map_zero(heap_mapped, n);
+        map_heap_pages(heap_mapped, n);
         heap_mapped += n * PAGE_SIZE;
     }
 
@@ -388,6 +543,24 @@ void *sbrk(ptrdiff_t increment)
 #endif
 
 
+/*
+ * Pages allocated from here on are accounted. The map covers memory that
+ * ballooning may add later, too; pages beyond it are never accounted.
+ */
+static void init_page_tags(unsigned long max_pfn)
+{
+    unsigned long n = max_pfn;
+
+#ifdef CONFIG_BALLOON
+    if ( nr_max_pages > n )
+        n = nr_max_pages;
+#endif
+    page_tags = (unsigned char *)alloc_pages(get_order(n));
+    if ( page_tags == NULL )
+        return;
+    memset(page_tags, MEM_TAG_NONE, PAGE_SIZE << get_order(n));
+    nr_page_tags = n;
+}
 
 void init_mm(void)
 {
@@ -402,6 +575,7 @@ void init_mm(void)
      * now we can initialise the page allocator
      */
     init_page_allocator(PFN_PHYS(start_pfn), PFN_PHYS(max_pfn));
+    init_page_tags(max_pfn);
     printk("MM: done\n");
 
     arch_init_p2m(max_pfn);
@@ -420,14 +594,19 @@ void fini_mm(void)
 void sanity_check(void)
 {
     int x;
+    unsigned long n;
     chunk_head_t *head;
 
     for (x = 0; x < FREELIST_SIZE; x++) {
+        n = 0;
         for (head = free_head[x]; !FREELIST_EMPTY(head); head = head->next) {
             ASSERT(!allocated_in_map(virt_to_pfn(head)));
             if (head->next)
                 ASSERT(head->next->pprev == &head->next);
+            n++;
         }
+        ASSERT(n == free_chunks[x]);
+        ASSERT(!!n == !!(free_orders & (1UL << x)));
         if (free_head[x]) {
             ASSERT(free_head[x]->pprev == &free_head[x]);
         }
@@ -118,7 +118,15 @@ moretodo:
 
         buf = &dev->rx_buffers[id];
         page = (unsigned char*)buf->page;
-        gnttab_end_access(buf->gref);
+
+        /*
+         * Take the page back before looking at it, so the backend cannot
+         * change the packet while we parse it. It is re-armed below.
+         */
+        if (!gnttab_revoke_access(buf->gref)) {
+            printk("netfront: backend still maps rx buffer %d, dropping\n", id);
+            continue;
+        }
 
         if (rx->status > NETIF_RSP_NULL)
         {
@@ -151,9 +159,10 @@ moretodo:
         struct net_buffer* buf = &dev->rx_buffers[id];
         void* page = buf->page;
 
-        /* We are sure to have free gnttab entries since they got released above */
-        buf->gref = req->gref = 
-            gnttab_grant_access(dev->dom,virt_to_mfn(page),0);
+        /* Hand the page back to the backend on the same grant */
+        if (!gnttab_regrant_access(buf->gref,dev->dom,virt_to_mfn(page),0))
+            buf->gref = gnttab_grant_access(dev->dom,virt_to_mfn(page),0);
+        req->gref = buf->gref;
 
         req->id = id;
     }
@@ -182,7 +191,6 @@ void network_tx_buf_gc(struct netfront_dev *dev)
         for (cons = dev->tx.rsp_cons; cons != prod; cons++) 
         {
             struct netif_tx_response *txrsp;
-            struct net_buffer *buf;
 
             txrsp = RING_GET_RESPONSE(&dev->tx, cons);
             if (txrsp->status == NETIF_RSP_NULL)
@@ -193,9 +201,7 @@ void network_tx_buf_gc(struct netfront_dev *dev)
 
             id  = txrsp->id;
             BUG_ON(id >= NET_TX_RING_SIZE);
-            buf = &dev->tx_buffers[id];
-            gnttab_end_access(buf->gref);
-            buf->gref=GRANT_INVALID_REF;
+            /* Its grant is kept and re-armed by the next netfront_xmit() */
 
 	    add_id_to_freelist(id,dev->tx_freelist);
 	    up(&dev->tx_sem);
@@ -274,9 +280,12 @@ static void free_netfront(struct netfront_dev *dev)
 	free_page(dev->rx_buffers[i].page);
     }
 
-    for(i=0;i<NET_TX_RING_SIZE;i++)
+    for(i=0;i<NET_TX_RING_SIZE;i++) {
+	if (dev->tx_buffers[i].gref != GRANT_INVALID_REF)
+	    gnttab_end_access(dev->tx_buffers[i].gref);
 	if (dev->tx_buffers[i].page)
 	    free_page(dev->tx_buffers[i].page);
+    }
 
     free(dev->nodename);
     free(dev);
@@ -324,6 +333,7 @@ struct netfront_dev *init_netfront(char *_nodename, void (*thenetif_rx)(unsigned
     {
 	add_id_to_freelist(i,dev->tx_freelist);
         dev->tx_buffers[i].page = NULL;
+        dev->tx_buffers[i].gref = GRANT_INVALID_REF;
     }
 
     for(i=0;i<NET_RX_RING_SIZE;i++)
@@ -619,8 +629,10 @@ void netfront_xmit(struct netfront_dev *dev, unsigned char* data,int len)
 
     memcpy(page,data,len);
 
-    buf->gref = 
-        tx->gref = gnttab_grant_access(dev->dom,virt_to_mfn(page),1);
+    if (buf->gref == GRANT_INVALID_REF ||
+        !gnttab_regrant_access(buf->gref,dev->dom,virt_to_mfn(page),1))
+        buf->gref = gnttab_grant_access(dev->dom,virt_to_mfn(page),1);
+    tx->gref = buf->gref;
 
     tx->offset=0;
     tx->size = len;
@@ -9,12 +9,27 @@
 #include <time.h>
 #include <mini-os/lib.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <mini-os/mm.h>
+#include <mini-os/balloon.h>
+#include <mini-os/sched.h>
+#include <mini-os/wait.h>
+#include <mini-os/lz4.h>
+#include <mini-os/slab.h>
+#include <mini-os/arena.h>
+#include <mini-os/memtag.h>
 #include <mini-os/posix/sys/mman.h>
 
 #include <mini-os/nnpback.h>
 #include <mini-os/utlist.h>
 
+/* Defined by model headers that carry a compressed image. */
+extern struct backend_lz4_image P4C8732DB_lz4 __attribute__((weak));
+extern struct backend_lz4_image P2D24C20E_lz4 __attribute__((weak));
+extern struct backend_lz4_image P264993A3_lz4 __attribute__((weak));
+extern struct backend_lz4_image PC37828B0_lz4 __attribute__((weak));
+extern struct backend_lz4_image P6614F490_lz4 __attribute__((weak));
+
 #include <mini-os/4C8732DB_backend.h> // squeezenet1_0
 #include <mini-os/2D24C20E_backend.h> // resnet18
 #include <mini-os/264993A3_backend.h> // alexnet
@@ -31,10 +46,42 @@
 #define NNPBACK_ERR(fmt,...) printk("Nnpback:Error " fmt, ##__VA_ARGS__)
 #define NNPBACK_LOG(fmt,...) printk("Nnpback:Info " fmt, ##__VA_ARGS__)
 
+/*
+ * Page backing that does not need to be physically or virtually
+ * contiguous: nr_pages pages held as a list of buddy blocks of
+ * whatever orders were free when it was gathered.
+ */
+struct page_extent {
+   unsigned long va;
+   int order;
+};
+
+struct page_extents {
+   int nr_pages;
+   int nr_extents;
+   int max_extents;
+   struct page_extent *extent;
+};
+
+/* An inclusive range of tensor or page indices. */
+struct nnp_range {
+   int first, last;
+};
+
+struct nnp_model;
+
 typedef struct el {
     domid_t domid;
+    struct nnp_model *model;
     grant_ref_t *grant_ref;
     grant_ref_t *grant_ref_ref;
+    struct page_extents ref_pages;
+    /* Pages of the packed model granted to this frontend. */
+    struct nnp_range pages;
+    /* Private copy-on-write pages replacing shared model pages. */
+    struct nnp_range *overlay_range;
+    int nr_overlay_ranges;
+    struct page_extents overlay;
     int total_page;
     int total_grant_ref_ref_page;
     struct el *next, *prev;
@@ -59,24 +106,129 @@ static struct thread* eventthread = NULL;
 static nnpback_dev_t gtpmdev = {
    .events = NULL,
 };
+/* Frontend records and queued attaches come and go with every attach. */
+static struct kmem_cache *el_cache;
+static struct kmem_cache *pending_cache;
+/* Counters changed since stats_thread last published them. */
+static int stats_dirty;
+#define NNPBACK_STATS_PERIOD 5000 /* ms */
+
+/*
+ * xenstore replies and error strings of the event being handled; reset
+ * once handle_backend_event() is done with it. Only the listener thread
+ * may use it.
+ */
+static struct arena req_arena = ARENA_INIT;
+
+#define NNPBACK_MAX_COW_RANGES 8
+
+/*
+ * An attach request, written by the frontend to
+ * /local/domain/frontend/<domid> as
+ *
+ *    <model> [tensors=<first>-<last>] [cow=<tensor>[-<tensor>][,...]]
+ *
+ * Tensors are indices into the model's parameter table. tensors limits
+ * the attach to the pages covering that range, the default being the
+ * whole model. cow lists the tensors the frontend wants private
+ * writable copies of; everything else is shared read-only.
+ */
+struct attach_req {
+   char model[32];
+   int has_tensors;
+   struct nnp_range tensors;
+   int nr_cow;
+   struct nnp_range cow[NNPBACK_MAX_COW_RANGES];
+};
+
+/*
+ * Parses a decimal index of at most INT_MAX, setting *end past it.
+ * Signs, spaces and out of range values are rejected with -1.
+ */
+static int parse_index(const char *s, char **end)
+{
+   unsigned long v;
+
+   if (*s < '0' || *s > '9')
+      return -1;
+   v = strtoul(s, end, 10);
+   return v > INT_MAX ? -1 : (int)v;
+}
+
+/* Parses "<a>[-<b>][,...]" into at most max ranges. */
+static int parse_ranges(const char *s, struct nnp_range *r, int max)
+{
+   char *end;
+   int n = 0;
+
+   while (*s) {
+      if (n == max)
+         return -1;
+      r[n].first = r[n].last = parse_index(s, &end);
+      if (r[n].first < 0)
+         return -1;
+      s = end;
+      if (*s == '-') {
+         r[n].last = parse_index(++s, &end);
+         if (r[n].last < r[n].first)
+            return -1;
+         s = end;
+      }
+      n++;
+      if (*s == ',')
+         s++;
+      else if (*s)
+         return -1;
+   }
+   return n;
+}
+
+static int parse_attach_req(const char *value, struct attach_req *req)
+{
+   char opt[64];
+   int len, n;
+
+   memset(req, 0, sizeof(*req));
+   if (sscanf(value, "%31s%n", req->model, &len) != 1)
+      return -1;
+   value += len;
+
+   while (sscanf(value, "%63s%n", opt, &len) == 1) {
+      value += len;
+      if (strncmp(opt, "tensors=", 8) == 0) {
+         if (parse_ranges(opt + 8, &req->tensors, 1) != 1)
+            return -1;
+         req->has_tensors = 1;
+      } else if (strncmp(opt, "cow=", 4) == 0) {
+         n = parse_ranges(opt + 4, req->cow, NNPBACK_MAX_COW_RANGES);
+         if (n < 0)
+            return -1;
+         req->nr_cow = n;
+      } else {
+         return -1;
+      }
+   }
+   return 0;
+}
 
 /* parses the string that comes out of xenbus_watch_wait_return. */
-static int parse_eventstr(const char* evstr, domid_t* domid, char* model)
+static int parse_eventstr(const char* evstr, domid_t* domid, struct attach_req *req)
 {
-   char* err;
    char* value;
    unsigned int udomid = 0;
+   int rc;
 
   if (sscanf(evstr, "/local/domain/frontend/%u", &udomid) == 1) {
       *domid = udomid;
-      if((err = xenbus_read(XBT_NIL, evstr, &value))) {
-         free(err);
+      if(xenbus_read_arena(XBT_NIL, evstr, &req_arena, &value))
          return EV_NONE;
-      }
 
-      sscanf(value, "%s", model);
-      free(value);
-      if (strcmp(model, "close") == 0) {
+      rc = parse_attach_req(value, req);
+      if (rc) {
+         NNPBACK_ERR("Malformed request from domain %u\n", udomid);
+         return EV_NONE;
+      }
+      if (strcmp(req->model, "close") == 0) {
          return EV_CLOSEFE;
       }
       return EV_NEWFE;
@@ -92,194 +244,863 @@ static inline size_t divide_round_up(size_t dividend, size_t divisor) {
    }
 }
 
-int log2(int v)
+static void free_page_extents(struct page_extents *pe)
+{
+   int i;
+
+   for (i = 0; i < pe->nr_extents; ++i)
+      free_pages((void*)pe->extent[i].va, pe->extent[i].order);
+   free(pe->extent);
+   memset(pe, 0, sizeof(*pe));
+}
+
+/*
+ * Gather exactly nr_pages pages, largest blocks first. When an order
+ * cannot be satisfied the remainder is collected from smaller orders,
+ * so only total free memory matters, not the size of the largest run.
+ * Orders are probed quietly with try_alloc_pages(); when free memory is
+ * short of what is still needed, the domain balloons up or reclaims
+ * before stepping down, and only a failure at order 0 is reported.
+ */
+static int alloc_page_extents(struct page_extents *pe, int nr_pages)
+{
+   struct page_extent *extent;
+   unsigned long va;
+   int remaining = nr_pages;
+   int order = 0, largest;
+
+   memset(pe, 0, sizeof(*pe));
+
+   while ((2 << order) <= remaining)
+      order++;
+
+   while (remaining > 0) {
+      while ((1 << order) > remaining)
+         order--;
+
+      va = try_alloc_pages(order);
+      if (!va && nr_free_pages < remaining &&
+          (chk_free_pages(remaining) ||
+           shrink_memory(remaining - nr_free_pages)))
+         va = try_alloc_pages(order);
+      if (!va && order == 0)
+         va = alloc_pages(0);
+      if (!va) {
+         if (order == 0) {
+            dump_page_allocator();
+            free_page_extents(pe);
+            return -ENOMEM;
+         }
+         /* Skip orders that are not there. */
+         largest = largest_free_order();
+         order = largest >= 0 && largest < order ? largest : order - 1;
+         continue;
+      }
+
+      if (pe->nr_extents == pe->max_extents) {
+         extent = realloc(pe->extent, sizeof(*extent) * (pe->max_extents + 8));
+         if (extent == NULL) {
+            free_pages((void*)va, order);
+            free_page_extents(pe);
+            return -ENOMEM;
+         }
+         pe->extent = extent;
+         pe->max_extents += 8;
+      }
+
+      pe->extent[pe->nr_extents].va = va;
+      pe->extent[pe->nr_extents].order = order;
+      pe->nr_extents++;
+      pe->nr_pages += 1 << order;
+      remaining -= 1 << order;
+   }
+
+   return 0;
+}
+
+/* Virtual address of the idx'th page of the backing. */
+static unsigned long page_extents_va(struct page_extents *pe, int idx)
+{
+   int i;
+
+   for (i = 0; i < pe->nr_extents; ++i) {
+      if (idx < (1 << pe->extent[i].order))
+         return pe->extent[i].va + idx * PAGE_SIZE;
+      idx -= 1 << pe->extent[i].order;
+   }
+
+   BUG();
+   return 0;
+}
+
+/* Copy len bytes from src to byte offset off of the backing. */
+static void copy_to_page_extents(struct page_extents *pe, size_t off,
+                                 const void *src, size_t len)
 {
-   if (v == 1)
+   size_t chunk;
+   int i;
+
+   for (i = 0; i < pe->nr_extents && len > 0; ++i) {
+      size_t size = (size_t)PAGE_SIZE << pe->extent[i].order;
+
+      if (off >= size) {
+         off -= size;
+         continue;
+      }
+
+      chunk = size - off;
+      if (chunk > len)
+         chunk = len;
+      memcpy((char*)pe->extent[i].va + off, src, chunk);
+      src = (const char*)src + chunk;
+      len -= chunk;
+      off = 0;
+   }
+
+   BUG_ON(len != 0);
+}
+
+/* Frames are handed to gnttab in batches of this many. */
+#define NNP_GRANT_BATCH 64
+
+struct grant_batch {
+   domid_t domid;
+   int readonly;
+   int nr;
+   unsigned long frame[NNP_GRANT_BATCH];
+   grant_ref_t *ref;
+};
+
+static void grant_batch_flush(struct grant_batch *b)
+{
+   if (b->nr == 0)
+      return;
+   gnttab_grant_access_batch_reserved(b->domid, b->frame, b->nr,
+                                      b->readonly, b->ref);
+   b->ref += b->nr;
+   b->nr = 0;
+}
+
+/* Queue va for granting, flushing first if the batch is full or differs. */
+static void grant_batch_add(struct grant_batch *b, unsigned long va,
+                            int readonly)
+{
+   if (b->nr == NNP_GRANT_BATCH || (b->nr && b->readonly != readonly))
+      grant_batch_flush(b);
+   b->readonly = readonly;
+   b->frame[b->nr++] = virt_to_mfn(va);
+}
+
+/*
+ * Grant every page of the backing to domid, one reference per page,
+ * out of entries the caller has gnttab_reserve()d.
+ */
+static void grant_page_extents(struct page_extents *pe, domid_t domid,
+                               int readonly, grant_ref_t *grant_ref)
+{
+   struct grant_batch b = { .domid = domid, .ref = grant_ref };
+   int i, j;
+
+   for (i = 0; i < pe->nr_extents; ++i)
+      for (j = 0; j < (1 << pe->extent[i].order); ++j)
+         grant_batch_add(&b, pe->extent[i].va + j * PAGE_SIZE, readonly);
+   grant_batch_flush(&b);
+}
+
+struct nnp_model {
+   const char *name;
+   struct backend_param *params;
+   int nr_params;
+   /* Byte offset of each tensor in the packed model, plus the total. */
+   size_t *param_offset;
+   /* Packed weights, empty until the model is first attached. */
+   struct page_extents pages;
+   /* Compressed image, or NULL if params holds the raw floats. */
+   struct backend_lz4_image *image;
+   /* One bit per page already expanded from the image. */
+   unsigned long *unpacked;
+   /* Attached frontends and attaches or prewarms in progress. */
+   int users;
+};
+
+#define NNP_MODEL(_name, _params, _image) \
+   { .name = _name, .params = _params, .nr_params = ARRAY_SIZE(_params), \
+     .image = _image }
+
+static struct nnp_model nnp_models[] = {
+   NNP_MODEL("squeezenet1_0", P4C8732DB_backend, &P4C8732DB_lz4),
+   NNP_MODEL("resnet18", P2D24C20E_backend, &P2D24C20E_lz4),
+   NNP_MODEL("alexnet", P264993A3_backend, &P264993A3_lz4),
+   NNP_MODEL("densenet121", PC37828B0_backend, &PC37828B0_lz4),
+   NNP_MODEL("vgg11", P6614F490_backend, &P6614F490_lz4),
+};
+
+static struct nnp_model *find_model(const char *name)
+{
+   int i;
+
+   for (i = 0; i < ARRAY_SIZE(nnp_models); ++i)
+      if (strcmp(nnp_models[i].name, name) == 0)
+         return &nnp_models[i];
+   return NULL;
+}
+
+/*
+ * Pack all parameters of the model back to back into its page backing.
+ * Compressed models only get their backing here; the pages are filled
+ * in by unpack_model_pages().
+ */
+static int pack_model(struct nnp_model *model)
+{
+   size_t total_bytes = 0, off = 0;
+   int i, total_page;
+
+   if (model->pages.nr_pages)
+      return 0;
+
+   model->param_offset = malloc(sizeof(size_t) * (model->nr_params + 1));
+   if (model->param_offset == NULL)
+      return -ENOMEM;
+   for (i = 0; i < model->nr_params; ++i) {
+      model->param_offset[i] = total_bytes;
+      total_bytes += model->params[i].param_size * sizeof(float);
+   }
+   model->param_offset[i] = total_bytes;
+   total_page = divide_round_up(total_bytes, PAGE_SIZE);
+
+   if (model->image && model->image->nr_blocks != total_page) {
+      NNPBACK_ERR("Image of %s has %d blocks for %d pages\n", model->name,
+                  model->image->nr_blocks, total_page);
+      goto fail;
+   }
+
+   if (alloc_page_extents(&model->pages, total_page)) {
+      NNPBACK_ERR("Unable to allocate %d pages for %s\n", total_page, model->name);
+      goto fail;
+   }
+
+   if (model->image) {
+      size_t map_size = divide_round_up(total_page, sizeof(unsigned long) * 8) *
+                        sizeof(unsigned long);
+
+      model->unpacked = malloc(map_size);
+      if (model->unpacked == NULL) {
+         free_page_extents(&model->pages);
+         goto fail;
+      }
+      memset(model->unpacked, 0, map_size);
+      NNPBACK_LOG("Reserved %d pages in %d extents for compressed %s\n",
+                  total_page, model->pages.nr_extents, model->name);
       return 0;
+   }
+
+   for (i = 0; i < model->nr_params; ++i) {
+      copy_to_page_extents(&model->pages, off, model->params[i].param_ptr,
+                           model->params[i].param_size * sizeof(float));
+      off += model->params[i].param_size * sizeof(float);
+   }
+   /* Do not leak stale memory through the tail of the last page. */
+   memset((char*)page_extents_va(&model->pages, total_page - 1) +
+          (off - (total_page - 1) * PAGE_SIZE), 0, total_page * PAGE_SIZE - off);
+
+   NNPBACK_LOG("Packed %s into %d pages in %d extents\n", model->name,
+               total_page, model->pages.nr_extents);
+   return 0;
 
-   return 1 + log2(v >> 1);
+fail:
+   free(model->param_offset);
+   model->param_offset = NULL;
+   return -ENOMEM;
+}
+
+/*
+ * Expand the pages of a compressed model in [pages.first, pages.last]
+ * that are not present yet, adding the number of bytes produced to
+ * *bytes. Each page is its own LZ4 block, so any subset can be done
+ * independently and in any order.
+ */
+static int unpack_model_pages(struct nnp_model *model, struct nnp_range pages,
+                              unsigned long *bytes)
+{
+   struct backend_lz4_image *image = model->image;
+   unsigned long va;
+   int p, n;
+
+   if (image == NULL)
+      return 0;
+
+   for (p = pages.first; p <= pages.last; ++p) {
+      if (test_bit(p, model->unpacked))
+         continue;
+
+      va = page_extents_va(&model->pages, p);
+      n = lz4_decompress(image->data + image->block_offset[p],
+                         image->block_offset[p + 1] - image->block_offset[p],
+                         (void*)va, PAGE_SIZE);
+      if (n < 0) {
+         NNPBACK_ERR("Corrupt block %d in image of %s\n", p, model->name);
+         return -EINVAL;
+      }
+      memset((char*)va + n, 0, PAGE_SIZE - n);
+      set_bit(p, model->unpacked);
+      *bytes += PAGE_SIZE;
+   }
+   return 0;
 }
 
-unsigned int round_up_power_of_two(unsigned int v) // compute the next highest power of 2 of 32-bit v
+/* Drop the packed pages of a model; the next attach packs it again. */
+static unsigned long release_model(struct nnp_model *model)
 {
-   v--;
-   v |= v >> 1;
-   v |= v >> 2;
-   v |= v >> 4;
-   v |= v >> 8;
-   v |= v >> 16;
-   v++;
+   unsigned long nr_pages = model->pages.nr_pages;
 
-   return v;
+   free_page_extents(&model->pages);
+   free(model->unpacked);
+   model->unpacked = NULL;
+   free(model->param_offset);
+   model->param_offset = NULL;
+   return nr_pages;
+}
+
+/* Packed models no frontend has attached are only a cache. */
+static unsigned long nnpback_shrink(struct shrinker *s, unsigned long nr_pages)
+{
+   unsigned long freed = 0;
+   int i;
+
+   for (i = 0; i < ARRAY_SIZE(nnp_models) && freed < nr_pages; ++i) {
+      if (nnp_models[i].users || nnp_models[i].pages.nr_pages == 0)
+         continue;
+      NNPBACK_LOG("Reclaiming %d pages of unattached %s\n",
+                  nnp_models[i].pages.nr_pages, nnp_models[i].name);
+      freed += release_model(&nnp_models[i]);
+   }
+   return freed;
+}
+
+static struct shrinker nnpback_shrinker = {
+   .name = "nnpback-models",
+   .priority = 10,
+   .shrink = nnpback_shrink,
+};
+
+static unsigned long usec_since(struct timeval *start)
+{
+   struct timeval now;
+
+   gettimeofday(&now, 0);
+   return ((now.tv_sec * 1000000) + now.tv_usec) - ((start->tv_sec * 1000000) + start->tv_usec);
+}
+
+/* Bytes per microsecond is MB/s. */
+static void log_unpack(struct nnp_model *model, unsigned long bytes,
+                       unsigned long e_usec)
+{
+   if (bytes == 0)
+      return;
+   NNPBACK_LOG("Decompressing %lu KB of %s takes %lu microseconds (%lu MB/s)\n",
+               bytes >> 10, model->name, e_usec, e_usec ? bytes / e_usec : 0);
 }
 
 el *head = NULL; /* important- initialize to NULL! */
-static float *squeezenet1_0_page = NULL;
-static float *resnet18_page = NULL;
-static float *alexnet_page = NULL;
-static float *densenet121_page = NULL;
-static float *vgg11_page = NULL;
+
+/*
+ * Attaches that did not fit in the free grant entries, retried in
+ * order by pending_thread once enough entries are free, whoever freed
+ * them, and after every detach.
+ */
+typedef struct pending_attach {
+   domid_t domid;
+   struct attach_req req;
+   struct pending_attach *next, *prev;
+} pending_attach;
+
+#define NNPBACK_MAX_PENDING 16
+#define NNPBACK_DEFAULT_GRANT_QUOTA 32768
+
+static pending_attach *pending = NULL;
+/* Grant entries the first queued attach was short of. */
+static int pending_needed;
+/* Set while drain_pending() runs. */
+static int draining;
+static DECLARE_WAIT_QUEUE_HEAD(pending_wq);
+/* Most grant entries a single frontend domain may hold. */
+static int grant_quota = NNPBACK_DEFAULT_GRANT_QUOTA;
+
+static void write_state(const char *frontend_path, int state, struct arena *a)
+{
+   char state_path[64], state_value[8];
+   char *err;
+
+   snprintf(state_path, 64, "%s/state", frontend_path);
+   snprintf(state_value, 8, "%d", state);
+   if((err = xenbus_write_arena(XBT_NIL, state_path, state_value, a)))
+       NNPBACK_ERR("Unable to write state path, error was %s\n", err);
+}
+
+/* Pages of the packed model covering tensors t; -1 if they are empty. */
+static int tensor_pages(struct nnp_model *model, struct nnp_range t,
+                        struct nnp_range *pages)
+{
+   size_t start = model->param_offset[t.first];
+   size_t end = model->param_offset[t.last + 1];
+
+   if (end == start)
+      return -1;
+   pages->first = start / PAGE_SIZE;
+   pages->last = (end - 1) / PAGE_SIZE;
+   return 0;
+}
+
+/* Record why an attach failed where the frontend can see it. */
+static void nnpback_error(const char *frontend_path, struct arena *a,
+                          const char *fmt, ...)
+{
+   char path[64], msg[128];
+   va_list args;
+
+   va_start(args, fmt);
+   vsnprintf(msg, sizeof(msg), fmt, args);
+   va_end(args);
+
+   NNPBACK_ERR("%s: %s\n", frontend_path, msg);
+   snprintf(path, 64, "%s/error", frontend_path);
+   xenbus_write_arena(XBT_NIL, path, msg, a);
+   write_state(frontend_path, NNPBACK_STATE_ERROR, a);
+}
+
+/* Grant entries currently held by attaches of domid. */
+static int grants_held(domid_t domid)
+{
+   el *elt;
+   int held = 0;
+
+   DL_FOREACH(head, elt)
+      if (elt->domid == domid)
+         held += elt->total_page + elt->total_grant_ref_ref_page;
+   return held;
+}
+
+/*
+ * Turn the requested copy-on-write tensor ranges into a sorted list of
+ * disjoint page ranges of the packed model. Tensors are not page
+ * aligned, so neighbouring tensors sharing a boundary page come along.
+ */
+static int build_overlay_ranges(el *elt, struct nnp_model *model,
+                                struct attach_req *req)
+{
+   struct nnp_range r, *out;
+   int i, j, n = 0;
+
+   if (req->nr_cow == 0)
+      return 0;
+
+   out = malloc(sizeof(*out) * req->nr_cow);
+   if (out == NULL)
+      return -ENOMEM;
+
+   for (i = 0; i < req->nr_cow; ++i) {
+      if (tensor_pages(model, req->cow[i], &r))
+         continue;
+
+      for (j = n; j > 0 && out[j - 1].first > r.first; --j)
+         out[j] = out[j - 1];
+      out[j] = r;
+      n++;
+   }
+
+   for (i = 0, j = 0; i < n; ++i) {
+      if (j > 0 && out[i].first <= out[j - 1].last + 1) {
+         if (out[i].last > out[j - 1].last)
+            out[j - 1].last = out[i].last;
+      } else {
+         out[j++] = out[i];
+      }
+   }
+
+   elt->overlay_range = out;
+   elt->nr_overlay_ranges = j;
+   for (i = 0; i < j; ++i)
+      elt->overlay.nr_pages += out[i].last - out[i].first + 1;
+   return 0;
+}
+
+/* Give the frontend private, writable copies of its overlay pages. */
+static int populate_overlay(el *elt, struct nnp_model *model)
+{
+   int i, p, k = 0, nr_pages = elt->overlay.nr_pages;
+
+   if (nr_pages == 0)
+      return 0;
+   if (alloc_page_extents(&elt->overlay, nr_pages))
+      return -ENOMEM;
+
+   for (i = 0; i < elt->nr_overlay_ranges; ++i)
+      for (p = elt->overlay_range[i].first; p <= elt->overlay_range[i].last; ++p)
+         memcpy((void*)page_extents_va(&elt->overlay, k++),
+                (void*)page_extents_va(&model->pages, p), PAGE_SIZE);
+   return 0;
+}
+
+/*
+ * Grant the packed model to the frontend out of reserved entries.
+ * Shared pages are read-only, pages covered by an overlay are replaced
+ * by the frontend's private writable copy.
+ */
+static void grant_model_pages(el *elt, struct nnp_model *model)
+{
+   struct grant_batch b = { .domid = elt->domid, .ref = elt->grant_ref };
+   unsigned long va;
+   int i, p, e = 0, j = elt->pages.first, r = 0, k = 0, readonly;
+
+   while (j >= (1 << model->pages.extent[e].order)) {
+      j -= 1 << model->pages.extent[e].order;
+      e++;
+   }
+
+   for (i = 0; i < elt->total_page; ++i) {
+      p = elt->pages.first + i;
+      va = model->pages.extent[e].va + j * PAGE_SIZE;
+      if (++j == (1 << model->pages.extent[e].order)) {
+         e++;
+         j = 0;
+      }
+
+      readonly = 1;
+      if (r < elt->nr_overlay_ranges && p >= elt->overlay_range[r].first) {
+         va = page_extents_va(&elt->overlay, k++);
+         readonly = 0;
+         if (p == elt->overlay_range[r].last)
+            r++;
+      }
+
+      grant_batch_add(&b, va, readonly);
+   }
+   grant_batch_flush(&b);
+}
+
+/*
+ * Revoke all grants of a frontend and release its private pages. Grants
+ * the frontend still has mapped cannot be revoked, so pages behind them
+ * are leaked rather than handed to the allocator for reuse; for model
+ * pages that means keeping the model pinned.
+ */
+static void free_el(el *elt)
+{
+   int data_ended = 1, refs_ended = 1;
+
+   if (elt->grant_ref)
+      data_ended = gnttab_end_access_batch(elt->grant_ref, elt->total_page) ==
+                   elt->total_page;
+   if (elt->grant_ref_ref)
+      refs_ended = gnttab_end_access_batch(elt->grant_ref_ref,
+                                           elt->total_grant_ref_ref_page) ==
+                   elt->total_grant_ref_ref_page;
+   if (!data_ended || !refs_ended)
+      NNPBACK_ERR("Domain %d still maps granted pages, leaking them\n",
+                  elt->domid);
+
+   if (refs_ended)
+      free_page_extents(&elt->ref_pages);
+   if (data_ended) {
+      free_page_extents(&elt->overlay);
+      if (elt->model)
+         elt->model->users--;
+   }
+   free(elt->overlay_range);
+   free(elt->grant_ref);
+   free(elt->grant_ref_ref);
+   kmem_cache_free(el_cache, elt);
+}
+
+/*
+ * Returns -EAGAIN without side effects if the grant entries the attach
+ * needs are not free right now, 0 once it has either been published or
+ * failed with an error reported to the frontend.
+ */
+static int attach_model(struct nnp_model *model, domid_t domid,
+                        struct attach_req *req, const char *frontend_path,
+                        struct arena *a)
+{
+   char *err;
+   int i, total_page, total_grant_ref_ref_page, needed;
+   char entry_path[64], entry_value[1024];
+   struct nnp_range tensors, pages;
+   struct timeval start;
+   unsigned long bytes = 0;
+   el *name;
+
+   if (pack_model(model)) {
+      nnpback_error(frontend_path, a, "out of memory packing %s", model->name);
+      return 0;
+   }
+
+   tensors.first = 0;
+   tensors.last = model->nr_params - 1;
+   if (req->has_tensors)
+      tensors = req->tensors;
+   if (tensors.first < 0 || tensors.first > tensors.last ||
+       tensors.last >= model->nr_params) {
+      nnpback_error(frontend_path, a, "%s has only %d tensors", model->name,
+                    model->nr_params);
+      return 0;
+   }
+   for (i = 0; i < req->nr_cow; ++i) {
+      if (req->cow[i].first > req->cow[i].last ||
+          req->cow[i].first < tensors.first || req->cow[i].last > tensors.last) {
+         nnpback_error(frontend_path, a, "cow tensors %d-%d outside of %d-%d",
+                       req->cow[i].first, req->cow[i].last,
+                       tensors.first, tensors.last);
+         return 0;
+      }
+   }
+   if (tensor_pages(model, tensors, &pages)) {
+      nnpback_error(frontend_path, a, "tensors %d-%d are empty",
+                    tensors.first, tensors.last);
+      return 0;
+   }
+   total_page = pages.last - pages.first + 1;
+   total_grant_ref_ref_page = divide_round_up(total_page * sizeof(grant_ref_t), PAGE_SIZE);
+
+   assert(total_grant_ref_ref_page <= 128);
+
+   /*
+    * Reserve every grant entry up front: running out half way would
+    * block this thread in the grant allocator, and with it the detaches
+    * that would free entries.
+    */
+   needed = total_page + total_grant_ref_ref_page;
+   if (needed > grant_quota - grants_held(domid)) {
+      nnpback_error(frontend_path, a, "needs %d grants, quota %d with %d in use",
+                    needed, grant_quota, grants_held(domid));
+      return 0;
+   }
+   if (gnttab_reserve(needed)) {
+      pending_needed = needed;
+      return -EAGAIN;
+   }
+
+   gettimeofday(&start, 0);
+   if (unpack_model_pages(model, pages, &bytes)) {
+      nnpback_error(frontend_path, a, "corrupt image of %s", model->name);
+      gnttab_unreserve(needed);
+      return 0;
+   }
+   log_unpack(model, bytes, usec_since(&start));
+
+   name = kmem_cache_alloc(el_cache);
+   if (name == NULL) {
+      nnpback_error(frontend_path, a, "out of memory");
+      gnttab_unreserve(needed);
+      return 0;
+   }
+   memset(name, 0, sizeof(*name));
+   name->domid = domid;
+   name->pages = pages;
+
+   if (build_overlay_ranges(name, model, req) || populate_overlay(name, model)) {
+      nnpback_error(frontend_path, a, "out of memory for overlay pages");
+      goto fail;
+   }
+
+   name->grant_ref = (grant_ref_t*)malloc(sizeof(grant_ref_t) * total_page);
+   name->grant_ref_ref = (grant_ref_t*)malloc(sizeof(grant_ref_t) * total_grant_ref_ref_page);
+   if (name->grant_ref == NULL || name->grant_ref_ref == NULL ||
+       alloc_page_extents(&name->ref_pages, total_grant_ref_ref_page)) {
+      nnpback_error(frontend_path, a, "out of memory for grant references");
+      goto fail;
+   }
+
+   name->total_page = total_page;
+   grant_model_pages(name, model);
+
+   copy_to_page_extents(&name->ref_pages, 0, name->grant_ref, total_page * sizeof(grant_ref_t));
+   name->total_grant_ref_ref_page = total_grant_ref_ref_page;
+   grant_page_extents(&name->ref_pages, domid, 1, name->grant_ref_ref);
+
+   snprintf(entry_value, 1024, "%s", "");
+   for (i = 0; i < total_grant_ref_ref_page; ++i) {
+         snprintf(entry_value + strlen(entry_value), 1024 - strlen(entry_value), "%lu ", (unsigned long)name->grant_ref_ref[i]);
+   }
+
+   snprintf(entry_path, 64, "%s/grant-ref-ref", frontend_path);
+   if((err = xenbus_write_arena(XBT_NIL, entry_path, entry_value, a)))
+      NNPBACK_ERR("Unable to write ring-ref, error was %s\n", err);
+
+   /* Page ranges the frontend may map writable. */
+   snprintf(entry_value, 1024, "%s", "");
+   for (i = 0; i < name->nr_overlay_ranges; ++i) {
+         snprintf(entry_value + strlen(entry_value), 1024 - strlen(entry_value), "%d-%d ",
+                  name->overlay_range[i].first, name->overlay_range[i].last);
+   }
+
+   snprintf(entry_path, 64, "%s/overlay-pages", frontend_path);
+   if((err = xenbus_write_arena(XBT_NIL, entry_path, entry_value, a)))
+      NNPBACK_ERR("Unable to write overlay-pages, error was %s\n", err);
+
+   /* Model pages the published references cover, in order. */
+   snprintf(entry_value, 1024, "%d-%d", pages.first, pages.last);
+   snprintf(entry_path, 64, "%s/pages", frontend_path);
+   if((err = xenbus_write_arena(XBT_NIL, entry_path, entry_value, a)))
+      NNPBACK_ERR("Unable to write pages, error was %s\n", err);
+
+   write_state(frontend_path, NNPBACK_STATE_CONNECTED, a);
+
+   name->model = model;
+   model->users++;
+   DL_APPEND(head, name);
+   return 0;
+
+fail:
+   gnttab_unreserve(needed);
+   free_el(name);
+   return 0;
+}
+
+static int attach_frontend(domid_t domid, struct attach_req *req,
+                           const char *frontend_path, struct arena *a)
+{
+   struct nnp_model *model;
+   int rc;
+
+   model = find_model(req->model);
+   if (model == NULL) {
+      nnpback_error(frontend_path, a, "unknown model %s", req->model);
+      return 0;
+   }
+
+   /* Keep the shrinker off the model while its pages are being set up. */
+   model->users++;
+   rc = attach_model(model, domid, req, frontend_path, a);
+   model->users--;
+   return rc;
+}
+
+static void queue_attach(domid_t domid, struct attach_req *req,
+                         const char *frontend_path, struct arena *a)
+{
+   pending_attach *p;
+   int count;
+
+   DL_COUNT(pending, p, count);
+   if (count >= NNPBACK_MAX_PENDING) {
+      nnpback_error(frontend_path, a, "grant table exhausted");
+      return;
+   }
+
+   p = kmem_cache_alloc(pending_cache);
+   if (p == NULL) {
+      nnpback_error(frontend_path, a, "out of memory");
+      return;
+   }
+   p->domid = domid;
+   p->req = *req;
+   DL_APPEND(pending, p);
+   wake_up(&pending_wq);
+
+   NNPBACK_LOG("Queued attach of %s by domain %d until grants are freed\n",
+               req->model, domid);
+   gnttab_dump_stats();
+   write_state(frontend_path, NNPBACK_STATE_QUEUED, a);
+}
+
+/*
+ * Retry queued attaches in arrival order until one still does not fit.
+ * Attaches block on xenbus, so the one being retried is off the list
+ * and a second caller leaves the list to the first. Retries run on
+ * either thread and keep their xenstore replies in their own arena;
+ * req_arena belongs to the listener.
+ */
+static void drain_pending(void)
+{
+   struct arena arena = ARENA_INIT;
+   pending_attach *p;
+   char frontend_path[32];
+   int rc;
+
+   if (draining)
+      return;
+   draining = 1;
+   while ((p = pending) != NULL) {
+      DL_DELETE(pending, p);
+      snprintf(frontend_path, 32, "/local/domain/backend/%d", p->domid);
+      rc = attach_frontend(p->domid, &p->req, frontend_path, &arena);
+      arena_release(&arena);
+      if (rc == -EAGAIN) {
+         DL_PREPEND(pending, p);
+         break;
+      }
+      kmem_cache_free(pending_cache, p);
+   }
+   draining = 0;
+   wake_up(&pending_wq);
+}
+
+/*
+ * Retry queued attaches when grant entries come back from anyone, or
+ * the table can grow, not only when one of our frontends detaches.
+ */
+static void pending_thread(void *p)
+{
+   for (;;) {
+      wait_event(pending_wq, pending != NULL && !draining);
+      gnttab_wait_free(pending_needed);
+      drain_pending();
+   }
+}
+
+static void detach_frontend(domid_t domid)
+{
+   el *elt, etmp;
+   pending_attach *p, *tmp;
+
+   DL_FOREACH_SAFE(pending, p, tmp) {
+      if (p->domid == domid) {
+         DL_DELETE(pending, p);
+         kmem_cache_free(pending_cache, p);
+      }
+   }
+
+   etmp.domid = domid;
+   DL_SEARCH(head, elt, &etmp, namecmp);
+   if (elt == NULL)
+      return;
+   DL_DELETE(head, elt);
+   free_el(elt);
+
+   drain_pending();
+}
 
 void handle_backend_event(char* evstr) {
    domid_t domid;
    int event;
    char *err;
-   int i, j, k = 0, total_item, total_bytes, total_page, total_grant_ref_ref_page;
-   char model[16], frontend_path[32];
-   char entry_path[64], entry_value[1024];
-   char state_path[64], state_value[8];
-   grant_ref_t *grant_ref, *grant_ref_ref;
-   void *page;
-   grant_ref_t *grant_ref_ref_page;
+   char frontend_path[32];
+   struct attach_req req;
 
-   struct timeval start, end;
+   struct timeval start;
    unsigned long e_usec;
-   el *name, *elt, etmp;
 
    NNPBACK_DEBUG("Xenbus Event: %s\n", evstr);
 
    gettimeofday(&start, 0);
-   event = parse_eventstr(evstr, &domid, model);
+   event = parse_eventstr(evstr, &domid, &req);
    
    if (event == EV_NEWFE) {
       snprintf(frontend_path, 32, "/local/domain/backend/%d", domid);
-      if((err = xenbus_write(XBT_NIL, frontend_path, "0"))) {
+      if((err = xenbus_write_arena(XBT_NIL, frontend_path, "0", &req_arena)))
          NNPBACK_ERR("Unable to write frontend domain id, error was %s\n", err);
-         free(err);
-      }
-
-      total_bytes = 0;
-      if (strcmp("squeezenet1_0", model) == 0) {
-         total_item = sizeof(P4C8732DB_backend) / sizeof(struct backend_param);
-         for (i = 0; i < total_item; ++i)
-            total_bytes += P4C8732DB_backend[i].param_size * sizeof(float);
-      } else if (strcmp("resnet18", model) == 0) {
-         total_item = sizeof(P2D24C20E_backend) / sizeof(struct backend_param);
-         for (i = 0; i < total_item; ++i)
-            total_bytes += P2D24C20E_backend[i].param_size * sizeof(float);
-      } else if (strcmp("alexnet", model) == 0) {
-         total_item = sizeof(P264993A3_backend) / sizeof(struct backend_param);
-         for (i = 0; i < total_item; ++i)
-            total_bytes += P264993A3_backend[i].param_size * sizeof(float);
-      } else if (strcmp("densenet121", model) == 0) {
-         total_item = sizeof(PC37828B0_backend) / sizeof(struct backend_param);
-         for (i = 0; i < total_item; ++i)
-            total_bytes += PC37828B0_backend[i].param_size * sizeof(float);
-      } else if (strcmp("vgg11", model) == 0) {
-         total_item = sizeof(P6614F490_backend) / sizeof(struct backend_param);
-         for (i = 0; i < total_item; ++i)
-            total_bytes += P6614F490_backend[i].param_size * sizeof(float);
-      } 
-
-      total_page = divide_round_up(total_bytes, PAGE_SIZE);
-
-      if (strcmp("squeezenet1_0", model) == 0) {
-         if (squeezenet1_0_page == NULL) {
-            squeezenet1_0_page = (float*)alloc_pages(log2(round_up_power_of_two(total_page)));
-
-            for (i = 0; i < total_item; ++i)
-               for (j = 0; j < P4C8732DB_backend[i].param_size; ++j)
-                  *(squeezenet1_0_page + k++) = *(P4C8732DB_backend[i].param_ptr + j);
-         }
-         page = (void*)squeezenet1_0_page;
-      } else if (strcmp("resnet18", model) == 0) {
-         if (resnet18_page == NULL) {
-            resnet18_page = (float*)alloc_pages(log2(round_up_power_of_two(total_page)));
-
-            for (i = 0; i < total_item; ++i)
-               for (j = 0; j < P2D24C20E_backend[i].param_size; ++j)
-                  *(resnet18_page + k++) = *(P2D24C20E_backend[i].param_ptr + j);
-         }
-         page = (void*)resnet18_page;
-      } else if (strcmp("alexnet", model) == 0) {
-         if (alexnet_page == NULL) {
-            alexnet_page = (float*)alloc_pages(log2(round_up_power_of_two(total_page)));
-
-            for (i = 0; i < total_item; ++i)
-               for (j = 0; j < P264993A3_backend[i].param_size; ++j)
-                  *(alexnet_page + k++) = *(P264993A3_backend[i].param_ptr + j);
-         }
-         page = (void*)alexnet_page;
-      } else if (strcmp("densenet121", model) == 0) {
-         if (densenet121_page == NULL) {
-            densenet121_page = (float*)alloc_pages(log2(round_up_power_of_two(total_page)));
-
-            for (i = 0; i < total_item; ++i)
-               for (j = 0; j < PC37828B0_backend[i].param_size; ++j)
-                  *(densenet121_page + k++) = *(PC37828B0_backend[i].param_ptr + j);
-         }
-         page = (void*)densenet121_page;
-      } else if (strcmp("vgg11", model) == 0) {
-         if (vgg11_page == NULL) {
-            vgg11_page = (float*)alloc_pages(log2(round_up_power_of_two(total_page)));
-
-            for (i = 0; i < total_item; ++i)
-               for (j = 0; j < P6614F490_backend[i].param_size; ++j)
-                  *(vgg11_page + k++) = *(P6614F490_backend[i].param_ptr + j);
-         }
-         page = (void*)vgg11_page;
-      }
 
-      grant_ref = (grant_ref_t*)malloc(sizeof(grant_ref_t) * total_page);
+      if (attach_frontend(domid, &req, frontend_path, &req_arena) == -EAGAIN)
+         queue_attach(domid, &req, frontend_path, &req_arena);
 
-      for (i = 0; i < total_page; ++i) {
-         grant_ref[i] = gnttab_grant_access(domid, virt_to_mfn((uintptr_t)page + i * PAGE_SIZE), 0);
-      }
-      
-      total_grant_ref_ref_page = divide_round_up(total_page * sizeof(grant_ref_t), PAGE_SIZE);
-      grant_ref_ref = (grant_ref_t*)malloc(sizeof(grant_ref_t) * total_grant_ref_ref_page);
-      grant_ref_ref_page = (grant_ref_t*)alloc_pages(log2(round_up_power_of_two(total_grant_ref_ref_page)));
-      
-      assert(total_grant_ref_ref_page <= 128);
-
-      for (i = 0; i < total_page; ++i)
-         grant_ref_ref_page[i] = grant_ref[i];
-
-      for (i = 0; i < total_grant_ref_ref_page; ++i)
-         grant_ref_ref[i] = gnttab_grant_access(domid, virt_to_mfn((uintptr_t)(void*)grant_ref_ref_page + i * PAGE_SIZE), 0);
-
-      snprintf(entry_value, 1024, "%s", "");
-      for (i = 0; i < total_grant_ref_ref_page; ++i) {
-            snprintf(entry_value + strlen(entry_value), 1024 - strlen(entry_value), "%lu ", (unsigned long)grant_ref_ref[i]);
-      }
-
-      snprintf(entry_path, 64, "%s/grant-ref-ref", frontend_path);
-      if((err = xenbus_write(XBT_NIL, entry_path, entry_value))) {
-         NNPBACK_ERR("Unable to write ring-ref, error was %s\n", err);
-         free(err);
-      }
-
-      snprintf(state_path, 64, "%s/state", frontend_path);
-      snprintf(state_value, 8, "%d", 1);
-      if((err = xenbus_write(XBT_NIL, state_path, state_value))) {
-          NNPBACK_ERR("Unable to write state path, error was %s\n", err);
-          free(err);
-      }
-      gettimeofday(&end, 0);
-
-      name = (el *)malloc(sizeof *name);
-      name->domid = domid;
-      name->grant_ref = grant_ref;
-      name->grant_ref_ref = grant_ref_ref;
-      name->total_page = total_page;
-      name->total_grant_ref_ref_page = total_grant_ref_ref_page;
-      DL_APPEND(head, name);
-      e_usec = ((end.tv_sec * 1000000) + end.tv_usec) - ((start.tv_sec * 1000000) + start.tv_usec);
+      e_usec = usec_since(&start);
       NNPBACK_LOG("Publishing grant references takes %lu microseconds\n", e_usec);
    } else if (event == EV_CLOSEFE) {
-      etmp.domid = domid;
-      DL_SEARCH(head, elt, &etmp, namecmp);
-      for (i = 0; i < elt->total_page; ++i) {
-         gnttab_end_access(elt->grant_ref[i]);
-      }
-      for (i = 0; i < elt->total_grant_ref_ref_page; ++i) {
-         gnttab_end_access(elt->grant_ref_ref[i]);
-      }
-      free(elt->grant_ref);
-      free(elt->grant_ref_ref);
-      DL_DELETE(head, elt);
-      free(elt);
+      detach_frontend(domid);
    }
+
+   stats_dirty = 1;
+   arena_reset(&req_arena);
 }
 
 static void event_listener(void)
@@ -314,15 +1135,98 @@ void event_thread(void* p) {
    event_listener();
 }
 
+/*
+ * Publish the grant table and memory counters at most every
+ * NNPBACK_STATS_PERIOD milliseconds, and only after attaches or
+ * detaches have changed them. Each write is a dozen or so xenstore
+ * round trips, too many to pay on every event.
+ */
+static void stats_thread(void *p)
+{
+   for (;;) {
+      msleep(NNPBACK_STATS_PERIOD);
+      if (!stats_dirty)
+         continue;
+      stats_dirty = 0;
+      gnttab_write_stats("/local/domain/backend/gnttab-stats");
+      mem_tags_write_stats("/local/domain/backend/mem-stats");
+   }
+}
+
+#define PREWARM_BATCH 64
+
+/*
+ * Pack and expand the models listed in /local/domain/backend/prewarm
+ * ahead of their first attach. Yields between batches of pages so the
+ * listener keeps serving attaches, which expand whatever pages they
+ * need that this thread has not reached yet.
+ */
+static void prewarm_thread(void *p)
+{
+   char *err, *value, *s;
+   char model_name[32];
+   struct nnp_model *model;
+   struct nnp_range pages;
+   struct timeval start;
+   unsigned long bytes, e_usec = 0;
+   int len;
+
+   if ((err = xenbus_read(XBT_NIL, "/local/domain/backend/prewarm", &value))) {
+      free(err);
+      return;
+   }
+
+   for (s = value; sscanf(s, "%31s%n", model_name, &len) == 1; s += len) {
+      model = find_model(model_name);
+      if (model == NULL)
+         continue;
+      model->users++;
+      if (pack_model(model)) {
+         model->users--;
+         continue;
+      }
+
+      bytes = 0;
+      e_usec = 0;
+      for (pages.first = 0; pages.first < model->pages.nr_pages;
+           pages.first += PREWARM_BATCH) {
+         pages.last = pages.first + PREWARM_BATCH - 1;
+         if (pages.last >= model->pages.nr_pages)
+            pages.last = model->pages.nr_pages - 1;
+
+         gettimeofday(&start, 0);
+         if (unpack_model_pages(model, pages, &bytes))
+            break;
+         e_usec += usec_since(&start);
+         schedule();
+      }
+      log_unpack(model, bytes, e_usec);
+      model->users--;
+   }
+   free(value);
+}
+
 void init_nnpback(void)
 {
    char* err;
    char value[16];
+   int quota;
+   /* Our caches and threads, and so all they allocate, are charged to us. */
+   unsigned int tag = mem_tag_set(MEM_TAG_NNPBACK);
 
    printk("============= Init NNP BACK ================\n");
 
    gnttab_reset_model();
 
+   el_cache = kmem_cache_create("nnpback-el", sizeof(el), __alignof__(el), NULL);
+   pending_cache = kmem_cache_create("nnpback-pending", sizeof(pending_attach),
+                                     __alignof__(pending_attach), NULL);
+   BUG_ON(el_cache == NULL || pending_cache == NULL);
+   register_shrinker(&nnpback_shrinker);
+
+   if ((quota = xenbus_read_integer("/local/domain/backend/grant-quota")) > 0)
+      grant_quota = quota;
+
    snprintf(value, 16, "%d", xenbus_get_self_id());
    if ((err = xenbus_write(XBT_NIL, "/local/domain/backend", value)))
    {
@@ -331,5 +1235,8 @@ void init_nnpback(void)
    }
 
    eventthread = create_thread("nnpback-listener", event_thread, NULL);
-
+   create_thread("nnpback-prewarm", prewarm_thread, NULL);
+   create_thread("nnpback-pending", pending_thread, NULL);
+   create_thread("nnpback-stats", stats_thread, NULL);
+   mem_tag_set(tag);
 }
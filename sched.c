@@ -42,6 +42,8 @@
 #include <mini-os/types.h>
 #include <mini-os/lib.h>
 #include <mini-os/xmalloc.h>
+#include <mini-os/slab.h>
+#include <mini-os/memtag.h>
 #include <mini-os/list.h>
 #include <mini-os/sched.h>
 #include <mini-os/semaphore.h>
@@ -57,6 +59,7 @@
 MINIOS_TAILQ_HEAD(thread_list, struct thread);
 
 struct thread *idle_thread = NULL;
+struct kmem_cache *thread_cache;
 static struct thread_list exited_threads = MINIOS_TAILQ_HEAD_INITIALIZER(exited_threads);
 static struct thread_list thread_list = MINIOS_TAILQ_HEAD_INITIALIZER(thread_list);
 static int threads_started;
@@ -116,7 +119,11 @@ void schedule(void)
     local_irq_restore(flags);
     /* Interrupting the switch is equivalent to having the next thread
        inturrupted at the return instruction. And therefore at safe point. */
-    if(prev != next) switch_threads(prev, next);
+    if(prev != next) {
+        prev->mem_tag = mem_tag_current;
+        mem_tag_current = next->mem_tag;
+        switch_threads(prev, next);
+    }
 
     MINIOS_TAILQ_FOREACH_SAFE(thread, &exited_threads, thread_list, tmp)
     {
@@ -124,7 +131,7 @@ void schedule(void)
         {
             MINIOS_TAILQ_REMOVE(&exited_threads, thread, thread_list);
             free_pages(thread->stack, STACK_SIZE_PAGE_ORDER);
-            xfree(thread);
+            kmem_cache_free(thread_cache, thread);
         }
     }
 }
@@ -138,6 +145,7 @@ struct thread* create_thread(char *name, void (*function)(void *), void *data)
     /* Not runable, not exited, not sleeping */
     thread->flags = 0;
     thread->wakeup_time = 0LL;
+    thread->mem_tag = mem_tag_current;
 #ifdef HAVE_LIBC
     _REENT_INIT_PTR((&thread->reent))
 #endif
@@ -242,6 +250,9 @@ void init_sched(void)
 #ifdef HAVE_LIBC
     _REENT_INIT_PTR((&callback_reent))
 #endif
+    thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+                                     __alignof__(struct thread), NULL);
+    BUG_ON(thread_cache == NULL);
     idle_thread = create_thread("Idle", idle_thread_fn, NULL);
 }
 
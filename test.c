@@ -36,6 +36,7 @@
 #include <mini-os/sched.h>
 #include <mini-os/xenbus.h>
 #include <mini-os/gnttab.h>
+#include <mini-os/gntcopy.h>
 #include <mini-os/netfront.h>
 #include <mini-os/blkfront.h>
 #include <mini-os/fbfront.h>
@@ -85,6 +86,306 @@ static void periodic_thread(void *p)
     }
 }
 
+#define GNTTAB_BENCH_PAGES 256
+
+#ifdef CONFIG_XENBUS
+static unsigned long pages_per_sec(int pages, s_time_t ns)
+{
+    return ns ? (unsigned long)((uint64_t)pages * 1000000000ULL / ns) : 0;
+}
+
+/* Map our own grants of frames page by page and then all at once. */
+static void gntmap_bench(unsigned long *frames)
+{
+    static uint32_t refs[GNTTAB_BENCH_PAGES];
+    struct gntmap map;
+    uint32_t domid = xenbus_get_self_id();
+    s_time_t t0, t1, t2;
+    void *pages[GNTTAB_BENCH_PAGES], *all;
+    unsigned long hits, misses;
+    int i;
+
+    gntmap_init(&map);
+    gntmap_set_max_grants(&map, GNTTAB_BENCH_PAGES);
+    for (i = 0; i < GNTTAB_BENCH_PAGES; i++)
+        refs[i] = gnttab_grant_access(domid, frames[i], 0);
+
+    t0 = NOW();
+    for (i = 0; i < GNTTAB_BENCH_PAGES; i++)
+        pages[i] = gntmap_map_grant_refs(&map, 1, &domid, 0, &refs[i], 1);
+    for (i = 0; i < GNTTAB_BENCH_PAGES; i++)
+        if (pages[i])
+            gntmap_munmap(&map, (unsigned long)pages[i], 1);
+    t1 = NOW();
+    all = gntmap_map_grant_refs(&map, GNTTAB_BENCH_PAGES, &domid, 0, refs, 1);
+    if (all)
+        gntmap_munmap(&map, (unsigned long)all, GNTTAB_BENCH_PAGES);
+    t2 = NOW();
+
+    printk("gntmap bench: map+unmap %d pages, single %lu pages/s, "
+           "batch %lu pages/s\n", GNTTAB_BENCH_PAGES,
+           pages_per_sec(GNTTAB_BENCH_PAGES, t1 - t0),
+           pages_per_sec(GNTTAB_BENCH_PAGES, t2 - t1));
+
+    /* Map every page twice through the persistent mapping cache. */
+    gntmap_set_cache(&map, GNTTAB_BENCH_PAGES);
+    t0 = NOW();
+    for (i = 0; i < 2 * GNTTAB_BENCH_PAGES; i++) {
+        all = gntmap_map_grant_refs(&map, 1, &domid, 0,
+                                    &refs[i % GNTTAB_BENCH_PAGES], 1);
+        if (all)
+            gntmap_munmap(&map, (unsigned long)all, 1);
+    }
+    t1 = NOW();
+    gntmap_cache_stats(&map, &hits, &misses);
+    printk("gntmap bench: cached %lu pages/s, %lu hits %lu misses\n",
+           pages_per_sec(2 * GNTTAB_BENCH_PAGES, t1 - t0), hits, misses);
+
+    gntmap_fini(&map);
+    for (i = 0; i < GNTTAB_BENCH_PAGES; i++)
+        gnttab_end_access(refs[i]);
+}
+
+/*
+ * Copy payloads of growing size into our own grants, once with batched
+ * GNTTABOP_copy and once by mapping, copying and unmapping each page.
+ */
+static void gntcopy_bench(unsigned long *frames)
+{
+    static uint32_t refs[GNTTAB_BENCH_PAGES];
+    static char buf[PAGE_SIZE];
+    struct gntmap map;
+    struct gntcopy copy;
+    uint32_t domid = xenbus_get_self_id();
+    s_time_t t0, t1, t2;
+    unsigned int size;
+    void *page;
+    int i;
+
+    gntmap_init(&map);
+    gntcopy_init(&copy);
+    for (i = 0; i < GNTTAB_BENCH_PAGES; i++)
+        refs[i] = gnttab_grant_access(domid, frames[i], 0);
+
+    for (size = 64; size <= PAGE_SIZE; size <<= 2) {
+        t0 = NOW();
+        for (i = 0; i < GNTTAB_BENCH_PAGES; i++)
+            gntcopy_to_ref(&copy, domid, refs[i], 0, buf, size, NULL);
+        if (gntcopy_flush(&copy))
+            printk("gntcopy bench: copy failed\n");
+        t1 = NOW();
+        for (i = 0; i < GNTTAB_BENCH_PAGES; i++) {
+            page = gntmap_map_grant_refs(&map, 1, &domid, 0, &refs[i], 1);
+            if (!page)
+                continue;
+            memcpy(page, buf, size);
+            gntmap_munmap(&map, (unsigned long)page, 1);
+        }
+        t2 = NOW();
+
+        printk("gntcopy bench: %4u bytes x %d, copy %lu ns, map+memcpy %lu ns\n",
+               size, GNTTAB_BENCH_PAGES, (unsigned long)(t1 - t0),
+               (unsigned long)(t2 - t1));
+    }
+
+    gntmap_fini(&map);
+    for (i = 0; i < GNTTAB_BENCH_PAGES; i++)
+        gnttab_end_access(refs[i]);
+}
+#endif
+
+/* Compare granting and revoking pages one at a time against in batches. */
+static void gnttab_bench_thread(void *p)
+{
+    static unsigned long frames[GNTTAB_BENCH_PAGES];
+    static grant_ref_t refs[GNTTAB_BENCH_PAGES];
+    unsigned long va;
+    s_time_t t0, t1, t2;
+    int i;
+
+    va = alloc_pages(8);
+    if (!va) {
+        printk("gnttab bench: no memory\n");
+        return;
+    }
+    for (i = 0; i < GNTTAB_BENCH_PAGES; i++)
+        frames[i] = virt_to_mfn(va + i * PAGE_SIZE);
+
+    t0 = NOW();
+    for (i = 0; i < GNTTAB_BENCH_PAGES; i++)
+        refs[i] = gnttab_grant_access(0, frames[i], 1);
+    for (i = 0; i < GNTTAB_BENCH_PAGES; i++)
+        gnttab_end_access(refs[i]);
+    t1 = NOW();
+    gnttab_grant_access_batch(0, frames, GNTTAB_BENCH_PAGES, 1, refs);
+    gnttab_end_access_batch(refs, GNTTAB_BENCH_PAGES);
+    t2 = NOW();
+
+    printk("gnttab bench: %d pages, single %lu ns, batch %lu ns\n",
+           GNTTAB_BENCH_PAGES, (unsigned long)(t1 - t0),
+           (unsigned long)(t2 - t1));
+
+#ifdef CONFIG_XENBUS
+    gntmap_bench(frames);
+    gntcopy_bench(frames);
+#endif
+    free_pages((void *)va, 8);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+#define PAGEWALK_ORDER   13
+#define PAGEWALK_TOUCHES (1UL << 22)
+
+static volatile unsigned long pagewalk_sink;
+
+/* Average ns to load one word from a random page of the mapping. */
+static unsigned long pagewalk_touch(volatile unsigned long *base,
+                                    unsigned long pages)
+{
+    unsigned long i, r = 1, sum = 0;
+    s_time_t t0 = NOW();
+
+    for (i = 0; i < PAGEWALK_TOUCHES; i++) {
+        r = r * 1103515245 + 12345;
+        sum += base[((r >> 8) % pages) * (PAGE_SIZE / sizeof(*base))];
+    }
+    pagewalk_sink = sum;
+    return (NOW() - t0) / PAGEWALK_TOUCHES;
+}
+
+/*
+ * Map the same block twice: 2MB-aligned, which uses superpages where
+ * the guest type allows them, and one page off that alignment, which
+ * has to use 4K pages, and time random accesses through each mapping.
+ */
+static void pagewalk_bench_thread(void *p)
+{
+    unsigned long *mfns, block, va, pages, i;
+    unsigned long ns_aligned, ns_4k;
+    int order = PAGEWALK_ORDER;
+
+    if (order > largest_free_order())
+        order = largest_free_order();
+    if (order < 9) {
+        printk("pagewalk bench: no memory\n");
+        return;
+    }
+    pages = 1UL << order;
+    block = alloc_pages(order);
+    mfns = xmalloc_array(unsigned long, pages);
+    va = allocate_ondemand(pages, L1_PAGETABLE_ENTRIES);
+    if (!block || !mfns || !va) {
+        printk("pagewalk bench: no memory\n");
+        goto out;
+    }
+    for (i = 0; i < pages; i++)
+        mfns[i] = virt_to_mfn(block + i * PAGE_SIZE);
+
+    do_map_frames(va, mfns, pages, 1, 0, DOMID_SELF, NULL, L1_PROT);
+    ns_aligned = pagewalk_touch((unsigned long *)va, pages);
+    unmap_frames(va, pages);
+
+    va = allocate_ondemand(pages + 1, L1_PAGETABLE_ENTRIES);
+    if (!va) {
+        printk("pagewalk bench: no address space\n");
+        goto out;
+    }
+    do_map_frames(va + PAGE_SIZE, mfns, pages, 1, 0, DOMID_SELF, NULL, L1_PROT);
+    ns_4k = pagewalk_touch((unsigned long *)(va + PAGE_SIZE), pages);
+    unmap_frames(va + PAGE_SIZE, pages);
+    free_ondemand(va, 1);
+
+    printk("pagewalk bench: %lu pages, %lu ns/access aligned, "
+           "%lu ns/access 4K\n", pages, ns_aligned, ns_4k);
+out:
+    xfree(mfns);
+    if (block)
+        free_pages((void *)block, order);
+}
+
+#define ONDEMAND_RANGES 8192
+#define ONDEMAND_BATCH  1024
+
+/*
+ * Reserve ever more single pages of the demand map area and report the
+ * cost per reservation of the first and the last batch, which should be
+ * about the same, then give them back in an interleaved order.
+ */
+static void ondemand_bench_thread(void *p)
+{
+    unsigned long *va, i, j;
+    s_time_t t0, first = 0, last = 0, release;
+
+    va = xmalloc_array(unsigned long, ONDEMAND_RANGES);
+    if (!va)
+        return;
+
+    for (i = 0; i < ONDEMAND_RANGES; i += ONDEMAND_BATCH) {
+        t0 = NOW();
+        for (j = i; j < i + ONDEMAND_BATCH; j++)
+            va[j] = allocate_ondemand(1 + (j & 3), 1);
+        last = NOW() - t0;
+        if (i == 0)
+            first = last;
+    }
+
+    t0 = NOW();
+    for (i = 0; i < ONDEMAND_RANGES; i += 2)
+        free_ondemand(va[i], 1 + (i & 3));
+    for (i = 1; i < ONDEMAND_RANGES; i += 2)
+        free_ondemand(va[i], 1 + (i & 3));
+    release = NOW() - t0;
+
+    printk("ondemand bench: %lu ns/alloc first batch, %lu ns/alloc last, "
+           "%lu ns/free\n", (unsigned long)(first / ONDEMAND_BATCH),
+           (unsigned long)(last / ONDEMAND_BATCH),
+           (unsigned long)(release / ONDEMAND_RANGES));
+    xfree(va);
+}
+
+#ifdef CONFIG_XENBUS
+#define GROW_TEST_ENTRIES 4096
+#define GROW_TEST_MAPS 4
+
+/*
+ * Reserve more grant entries than the table starts with, so that it
+ * grows, then take some on-demand mappings. Growing must keep the
+ * table's address space reserved: had it been given back, the mappings
+ * would land on the table and ending the grants would fault.
+ */
+static void gnttab_grow_test_thread(void *p)
+{
+    static grant_ref_t refs[GROW_TEST_ENTRIES];
+    void *map[GROW_TEST_MAPS];
+    unsigned long page;
+    domid_t self = xenbus_get_self_id();
+    int i, ended;
+
+    page = alloc_page();
+    if (!page || gnttab_reserve(GROW_TEST_ENTRIES)) {
+        printk("gnttab grow test: cannot reserve %d entries\n",
+               GROW_TEST_ENTRIES);
+        if (page)
+            free_page((void *)page);
+        return;
+    }
+    for (i = 0; i < GROW_TEST_ENTRIES; i++)
+        refs[i] = gnttab_grant_access_reserved(self, virt_to_mfn(page), 1);
+
+    for (i = 0; i < GROW_TEST_MAPS; i++)
+        map[i] = map_zero(GROW_TEST_MAPS - i, 1);
+    ended = gnttab_end_access_batch(refs, GROW_TEST_ENTRIES);
+    for (i = 0; i < GROW_TEST_MAPS; i++)
+        if (map[i])
+            unmap_frames((unsigned long)map[i], GROW_TEST_MAPS - i);
+    free_page((void *)page);
+
+    printk("gnttab grow test: %s\n",
+           ended == GROW_TEST_ENTRIES ? "passed" : "FAILED");
+}
+#endif
+#endif
+
 #ifdef CONFIG_NETFRONT
 static struct netfront_dev *net_dev;
 static struct semaphore net_sem = __SEMAPHORE_INITIALIZER(net_sem, 0);
@@ -559,6 +860,14 @@ int app_main(void *p)
     create_thread("xenbus_tester", xenbus_tester, p);
 #endif
     create_thread("periodic_thread", periodic_thread, p);
+    create_thread("gnttab_bench", gnttab_bench_thread, p);
+#if defined(__i386__) || defined(__x86_64__)
+    create_thread("pagewalk_bench", pagewalk_bench_thread, p);
+    create_thread("ondemand_bench", ondemand_bench_thread, p);
+#ifdef CONFIG_XENBUS
+    create_thread("gnttab_grow_test", gnttab_grow_test_thread, p);
+#endif
+#endif
 #ifdef CONFIG_NETFRONT
     create_thread("netfront", netfront_thread, p);
 #endif
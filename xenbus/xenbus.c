@@ -29,6 +29,8 @@
 #include <xen/hvm/params.h>
 #include <mini-os/spinlock.h>
 #include <mini-os/xmalloc.h>
+#include <mini-os/arena.h>
+#include <mini-os/memtag.h>
 
 #define min(x,y) ({                       \
         typeof(x) tmpx = (x);                 \
@@ -58,6 +60,8 @@ struct xenbus_req_info
     int in_use:1;
     struct wait_queue_head waitq;
     void *reply;
+    /* Where to put the reply, NULL for the heap. */
+    struct arena *arena;
 };
 
 #define NR_REQS 32
@@ -218,11 +222,29 @@ char *xenbus_wait_for_state_change(const char* path, XenbusState *state, xenbus_
 }
 
 
+/*
+ * Replies, and the strings handed back to callers, come from the
+ * caller's arena if it passed one and from the heap otherwise.
+ */
+static void *xb_alloc(struct arena *a, size_t size)
+{
+    return a ? arena_alloc(a, size, 1) : malloc(size);
+}
+
+static void xb_free(struct arena *a, void *p)
+{
+    if (!a)
+        free(p);
+}
+
 static void xenbus_thread_func(void *ign)
 {
     struct xsd_sockmsg msg;
     unsigned prod = xenstore_buf->rsp_prod;
 
+    /* Replies and watch events count as xenbus memory until freed. */
+    mem_tag_set(MEM_TAG_XENBUS);
+
     for (;;) 
     {
         wait_event(xb_waitq, prod != xenstore_buf->rsp_prod);
@@ -284,7 +306,8 @@ static void xenbus_thread_func(void *ign)
 
             else
             {
-                req_info[msg.req_id].reply = malloc(sizeof(msg) + msg.len);
+                req_info[msg.req_id].reply =
+                    xb_alloc(req_info[msg.req_id].arena, sizeof(msg) + msg.len);
                 memcpy_from_ring(xenstore_buf->rsp,
                     req_info[msg.req_id].reply,
                     MASK_XENSTORE_IDX(xenstore_buf->rsp_cons),
@@ -452,18 +475,20 @@ static void xb_write(int type, int req_id, xenbus_transaction_t trans_id,
 
 /* Send a mesasge to xenbus, in the same fashion as xb_write, and
    block waiting for a reply.  The reply is malloced and should be
-   freed by the caller. */
+   freed by the caller, unless it was put in arena a. */
 struct xsd_sockmsg *
-xenbus_msg_reply(int type,
-		 xenbus_transaction_t trans,
-		 struct write_req *io,
-		 int nr_reqs)
+xenbus_msg_reply_arena(int type,
+                       xenbus_transaction_t trans,
+                       struct write_req *io,
+                       int nr_reqs,
+                       struct arena *a)
 {
     int id;
     DEFINE_WAIT(w);
     struct xsd_sockmsg *rep;
 
     id = allocate_xenbus_id();
+    req_info[id].arena = a;
     add_waiter(w, req_info[id].waitq);
 
     xb_write(type, id, trans, io, nr_reqs);
@@ -478,20 +503,29 @@ xenbus_msg_reply(int type,
     return rep;
 }
 
-static char *errmsg(struct xsd_sockmsg *rep)
+struct xsd_sockmsg *
+xenbus_msg_reply(int type,
+		 xenbus_transaction_t trans,
+		 struct write_req *io,
+		 int nr_reqs)
+{
+    return xenbus_msg_reply_arena(type, trans, io, nr_reqs, NULL);
+}
+
+static char *errmsg(struct xsd_sockmsg *rep, struct arena *a)
 {
     char *res;
     if (!rep) {
 	char msg[] = "No reply";
 	size_t len = strlen(msg) + 1;
-	return memcpy(malloc(len), msg, len);
+	return memcpy(xb_alloc(a, len), msg, len);
     }
     if (rep->type != XS_ERROR)
 	return NULL;
-    res = malloc(rep->len + 1);
+    res = xb_alloc(a, rep->len + 1);
     memcpy(res, rep + 1, rep->len);
     res[rep->len] = 0;
-    free(rep);
+    xb_free(a, rep);
     return res;
 }	
 
@@ -513,15 +547,16 @@ static void xenbus_debug_msg(const char *msg)
 /* List the contents of a directory.  Returns a malloc()ed array of
    pointers to malloc()ed strings.  The array is NULL terminated.  May
    block. */
-char *xenbus_ls(xenbus_transaction_t xbt, const char *pre, char ***contents)
+char *xenbus_ls_arena(xenbus_transaction_t xbt, const char *pre,
+                      struct arena *a, char ***contents)
 {
     struct xsd_sockmsg *reply, *repmsg;
     struct write_req req[] = { { pre, strlen(pre)+1 } };
     int nr_elems, x, i;
     char **res, *msg;
 
-    repmsg = xenbus_msg_reply(XS_DIRECTORY, xbt, req, ARRAY_SIZE(req));
-    msg = errmsg(repmsg);
+    repmsg = xenbus_msg_reply_arena(XS_DIRECTORY, xbt, req, ARRAY_SIZE(req), a);
+    msg = errmsg(repmsg, a);
     if (msg) {
 	*contents = NULL;
 	return msg;
@@ -529,39 +564,56 @@ char *xenbus_ls(xenbus_transaction_t xbt, const char *pre, char ***contents)
     reply = repmsg + 1;
     for (x = nr_elems = 0; x < repmsg->len; x++)
         nr_elems += (((char *)reply)[x] == 0);
-    res = malloc(sizeof(res[0]) * (nr_elems + 1));
+    res = xb_alloc(a, sizeof(res[0]) * (nr_elems + 1));
     for (x = i = 0; i < nr_elems; i++) {
         int l = strlen((char *)reply + x);
-        res[i] = malloc(l + 1);
-        memcpy(res[i], (char *)reply + x, l + 1);
+        if (a) {
+            /* The reply lives as long as the arena: point into it. */
+            res[i] = (char *)reply + x;
+        } else {
+            res[i] = malloc(l + 1);
+            memcpy(res[i], (char *)reply + x, l + 1);
+        }
         x += l + 1;
     }
     res[i] = NULL;
-    free(repmsg);
+    xb_free(a, repmsg);
     *contents = res;
     return NULL;
 }
 
-char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value)
+char *xenbus_ls(xenbus_transaction_t xbt, const char *pre, char ***contents)
+{
+    return xenbus_ls_arena(xbt, pre, NULL, contents);
+}
+
+char *xenbus_read_arena(xenbus_transaction_t xbt, const char *path,
+                        struct arena *a, char **value)
 {
     struct write_req req[] = { {path, strlen(path) + 1} };
     struct xsd_sockmsg *rep;
     char *res, *msg;
-    rep = xenbus_msg_reply(XS_READ, xbt, req, ARRAY_SIZE(req));
-    msg = errmsg(rep);
+    rep = xenbus_msg_reply_arena(XS_READ, xbt, req, ARRAY_SIZE(req), a);
+    msg = errmsg(rep, a);
     if (msg) {
 	*value = NULL;
 	return msg;
     }
-    res = malloc(rep->len + 1);
+    res = xb_alloc(a, rep->len + 1);
     memcpy(res, rep + 1, rep->len);
     res[rep->len] = 0;
-    free(rep);
+    xb_free(a, rep);
     *value = res;
     return NULL;
 }
 
-char *xenbus_write(xenbus_transaction_t xbt, const char *path, const char *value)
+char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value)
+{
+    return xenbus_read_arena(xbt, path, NULL, value);
+}
+
+char *xenbus_write_arena(xenbus_transaction_t xbt, const char *path,
+                         const char *value, struct arena *a)
 {
     struct write_req req[] = { 
 	{path, strlen(path) + 1},
@@ -569,13 +621,18 @@ char *xenbus_write(xenbus_transaction_t xbt, const char *path, const char *value
     };
     struct xsd_sockmsg *rep;
     char *msg;
-    rep = xenbus_msg_reply(XS_WRITE, xbt, req, ARRAY_SIZE(req));
-    msg = errmsg(rep);
+    rep = xenbus_msg_reply_arena(XS_WRITE, xbt, req, ARRAY_SIZE(req), a);
+    msg = errmsg(rep, a);
     if (msg) return msg;
-    free(rep);
+    xb_free(a, rep);
     return NULL;
 }
 
+char *xenbus_write(xenbus_transaction_t xbt, const char *path, const char *value)
+{
+    return xenbus_write_arena(xbt, path, value, NULL);
+}
+
 char* xenbus_watch_path_token( xenbus_transaction_t xbt, const char *path, const char *token, xenbus_event_queue *events)
 {
     struct xsd_sockmsg *rep;
@@ -599,7 +656,7 @@ char* xenbus_watch_path_token( xenbus_transaction_t xbt, const char *path, const
 
     rep = xenbus_msg_reply(XS_WATCH, xbt, req, ARRAY_SIZE(req));
 
-    msg = errmsg(rep);
+    msg = errmsg(rep, NULL);
     if (msg) return msg;
     free(rep);
 
@@ -621,7 +678,7 @@ char* xenbus_unwatch_path_token( xenbus_transaction_t xbt, const char *path, con
 
     rep = xenbus_msg_reply(XS_UNWATCH, xbt, req, ARRAY_SIZE(req));
 
-    msg = errmsg(rep);
+    msg = errmsg(rep, NULL);
     if (msg) return msg;
     free(rep);
 
@@ -642,7 +699,7 @@ char *xenbus_rm(xenbus_transaction_t xbt, const char *path)
     struct xsd_sockmsg *rep;
     char *msg;
     rep = xenbus_msg_reply(XS_RM, xbt, req, ARRAY_SIZE(req));
-    msg = errmsg(rep);
+    msg = errmsg(rep, NULL);
     if (msg)
 	return msg;
     free(rep);
@@ -655,7 +712,7 @@ char *xenbus_get_perms(xenbus_transaction_t xbt, const char *path, char **value)
     struct xsd_sockmsg *rep;
     char *res, *msg;
     rep = xenbus_msg_reply(XS_GET_PERMS, xbt, req, ARRAY_SIZE(req));
-    msg = errmsg(rep);
+    msg = errmsg(rep, NULL);
     if (msg) {
 	*value = NULL;
 	return msg;
@@ -681,7 +738,7 @@ char *xenbus_set_perms(xenbus_transaction_t xbt, const char *path, domid_t dom,
     snprintf(value, PERM_MAX_SIZE, "%c%hu", perm, dom);
     req[1].len = strlen(value) + 1;
     rep = xenbus_msg_reply(XS_SET_PERMS, xbt, req, ARRAY_SIZE(req));
-    msg = errmsg(rep);
+    msg = errmsg(rep, NULL);
     if (msg)
 	return msg;
     free(rep);
@@ -697,7 +754,7 @@ char *xenbus_transaction_start(xenbus_transaction_t *xbt)
     char *err;
 
     rep = xenbus_msg_reply(XS_TRANSACTION_START, 0, &req, 1);
-    err = errmsg(rep);
+    err = errmsg(rep, NULL);
     if (err)
 	return err;
     sscanf((char *)(rep + 1), "%lu", xbt);
@@ -717,7 +774,7 @@ xenbus_transaction_end(xenbus_transaction_t t, int abort, int *retry)
     req.data = abort ? "F" : "T";
     req.len = 2;
     rep = xenbus_msg_reply(XS_TRANSACTION_END, t, &req, 1);
-    err = errmsg(rep);
+    err = errmsg(rep, NULL);
     if (err) {
 	if (!strcmp(err, "EAGAIN")) {
 	    *retry = 1;